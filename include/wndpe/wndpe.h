@@ -1,19 +1,300 @@
 #ifndef WNDPE_H_INCLUDED
 #define WNDPE_H_INCLUDED 1
 
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <filesystem>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <wasm.h>
 
 namespace wndpe {
 
-std::unique_ptr<wasm::Module> loadModule(const std::filesystem::path& path);
+// Verbosity of the diagnostics printed to stderr. Messages above
+// WNDPE_MAX_LOG_LEVEL (a build option) are compiled out entirely.
+enum class LogLevel { Quiet = 0, Info = 1, Debug = 2, Trace = 3 };
 
-void runOutliningPasses(wasm::Module& wmod);
+void setLogLevel(LogLevel level);
+LogLevel getLogLevel();
 
-void writeWat(wasm::Module& wmod, const std::filesystem::path& outPath);
+// Wall-clock seconds spent in each phase. cfg (the whole liveness analysis)
+// and copy are summed over all functions, so with parallel workers they can
+// exceed the outlining time.
+struct PhaseTimings {
+  double load = 0;
+  double validate = 0;
+  double candidates = 0;
+  double outlining = 0;
+  double cfg = 0;
+  double copy = 0;
+  double dce = 0;
+  double write = 0;
+};
+
+struct FunctionStats {
+  std::string name;
+  std::size_t regions = 0;
+  std::size_t basicBlocks = 0;
+  double cfgSeconds = 0;
+  double copySeconds = 0;
+  // Expressions in the generated outlined functions.
+  std::size_t expressionsCopied = 0;
+  std::uint64_t commBlockBytes = 0;
+  // Regions offloaded in batches, see OutliningOptions::batchRecords.
+  std::size_t batchedRegions = 0;
+};
+
+// Collected by the API functions that take a Stats*. Counts accumulate over
+// every call that is given the same object.
+struct Stats {
+  PhaseTimings phases;
+  std::size_t functionsOutlined = 0;
+  std::size_t regions = 0;
+  std::size_t basicBlocks = 0;
+  std::size_t expressionsCopied = 0;
+  std::uint64_t commBlockBytes = 0;
+  std::size_t batchedRegions = 0;
+  // Functions whose result or analysis was reused from the cache, or whose
+  // analysis was added to it.
+  std::size_t cacheHits = 0;
+  std::size_t cacheMisses = 0;
+  // Peak resident set size of the process, sampled at the end of each phase.
+  std::uint64_t peakRssBytes = 0;
+  std::vector<FunctionStats> functions;
+
+  void samplePeakMemory();
+  std::string toJson() const;
+};
+
+// Thrown by the load and write functions for malformed, invalid or
+// unreadable modules and for I/O failures, and by runOutliningPasses for
+// markers it can't outline.
+class ModuleError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Loads a binary or text module, told apart by the wasm magic number rather
+// than the file extension.
+std::unique_ptr<wasm::Module> loadModule(const std::filesystem::path& path,
+                                         Stats* stats = nullptr);
+
+// Same as above from memory, e.g. a mapped file. sourceMap optionally holds
+// the source map of a binary module; the data isn't referenced after the
+// call returns.
+std::unique_ptr<wasm::Module> loadModule(std::span<const std::byte> data,
+                                         std::string_view sourceMap = {},
+                                         Stats* stats = nullptr);
+
+// Tuning of the automatic offload candidate discovery.
+struct CandidateOptions {
+  // Regions scoring below this are never marked.
+  double minScore = 1.0;
+  // Upper bound on the number of regions marked in the whole module, 0 for no
+  // limit.
+  std::size_t maxRegions = 0;
+  // Upper bound on the number of disjoint regions marked in one function, 0
+  // for no limit.
+  std::size_t maxRegionsPerFunction = 4;
+};
+
+// A loop scored by the candidate discovery.
+struct OffloadCandidate {
+  std::string function;
+  // Label of the loop, empty if it has none.
+  std::string label;
+  double score = 0;
+  // Static counts inside the region; instructions and memory operations in
+  // nested loops are weighted by their nesting depth.
+  double instructions = 0;
+  double memoryOps = 0;
+  double chasedLoads = 0;
+  // Upper bound of the state shipped through the comm block.
+  std::uint32_t liveBytes = 0;
+  bool marked = false;
+};
+
+// Scores every single-entry/single-exit loop of the module by memory
+// intensity and wraps the best ones in outlining markers. Functions that
+// already contain markers are left alone, and so are loops the outlining pass
+// would reject (tail calls, loops in a try body). Returns all scored loops,
+// best first.
+std::vector<OffloadCandidate>
+markOffloadCandidates(wasm::Module& wmod, const CandidateOptions& options);
+
+// One term scale * v of an address, where v is the value of a local inside
+// an outlined region.
+struct AddressTerm {
+  // Comm block offset of the input slot v starts at, -1 if it starts at
+  // initial instead.
+  std::int64_t slotOffset = -1;
+  std::int64_t initial = 0;
+  // Added to v by each update, 0 if v doesn't change in the region.
+  std::int64_t step = 0;
+  std::int64_t scale = 1;
+
+  bool operator==(const AddressTerm&) const = default;
+};
+
+// A memory access of an outlined region, at address offset + sum(terms).
+struct MemoryAccess {
+  // Opaque stands for a call or memory.grow, which may touch anything.
+  enum class Kind { Load, Store, CopySource, CopyDest, Fill, Opaque };
+
+  Kind kind = Kind::Load;
+  std::int64_t offset = 0;
+  std::vector<AddressTerm> terms;
+  // Bytes accessed at the address, for bulk operations plus lengthTerms.
+  std::int64_t bytes = 0;
+  std::vector<AddressTerm> lengthTerms;
+  // The address (or length) can't be expressed with the terms above.
+  bool unknown = false;
+
+  bool operator==(const MemoryAccess&) const = default;
+};
+
+// Static memory footprint of one outlined region. Identical accesses are
+// listed once.
+struct RegionFootprint {
+  // The outlined function.
+  std::string function;
+  std::uint32_t commBlockSize = 0;
+  std::vector<MemoryAccess> accesses;
+  // No access is unknown or opaque and none depends on an induction
+  // variable, whose trip count isn't derived, so the runtime may ship just
+  // the pages they reach instead of the whole memory.
+  bool complete = true;
+};
+
+struct OutliningReport {
+  // In module order of the outlined functions.
+  std::vector<RegionFootprint> regions;
+
+  std::string toJson() const;
+};
+
+struct OutliningOptions {
+  // Run markOffloadCandidates before outlining.
+  bool autoDetect = false;
+  CandidateOptions candidates;
+  // Receives the candidate report when autoDetect is set.
+  std::vector<OffloadCandidate>* candidateReport = nullptr;
+  // Directory caching the result of outlining each function (the rewritten
+  // function, the generated ones and their footprints) and its analysis, by a
+  // hash of its contents, so unchanged functions skip the work on the next
+  // run. Only the analysis is reused while binaryen's colors are enabled.
+  // Empty to disable. May be shared by concurrent runs.
+  std::filesystem::path cacheDir;
+  // Receives a copy of the module as it was right before outlining (after
+  // candidate marking), e.g. for simulateOffload.
+  std::unique_ptr<wasm::Module>* originalModule = nullptr;
+  // Receives the memory footprint of every outlined region.
+  OutliningReport* report = nullptr;
+  // A region making up a loop body, together with code that only computes
+  // on locals, is offloaded in batches of up to this many iterations instead
+  // of once per iteration. 0 or 1 to disable.
+  std::uint32_t batchRecords = 64;
+  // Serve comm blocks from free lists kept in the module, going to the
+  // runtime's alloc intrinsic only when a list is empty or a block is large.
+  bool commPool = true;
+  Stats* stats = nullptr;
+};
+
+void runOutliningPasses(wasm::Module& wmod,
+                        const OutliningOptions& options = {});
+
+// Cost model of a host reaching its data through a link and a near-data
+// processor (NDP) sitting next to the data.
+struct LinkModel {
+  // Round trip of one offload call.
+  double latencySeconds = 2e-6;
+  // Link bandwidth in bytes per second, paid by comm block transfers.
+  double linkBandwidth = 8e9;
+  // Memory bandwidth seen by code on the host and on the NDP.
+  double hostBandwidth = 4e9;
+  double ndpBandwidth = 32e9;
+};
+
+// Memory traffic of one interpreted run. "Region" traffic happens between
+// outlining markers in the original module, or inside offloaded calls in the
+// outlined one.
+struct SimulatedRun {
+  std::uint64_t hostLoadBytes = 0;
+  std::uint64_t hostStoreBytes = 0;
+  std::uint64_t regionLoadBytes = 0;
+  std::uint64_t regionStoreBytes = 0;
+  std::size_t offloadCalls = 0;
+  // Comm blocks shipped to the NDP and back, counted in both directions.
+  std::uint64_t commBytes = 0;
+  wasm::Literals results;
+};
+
+struct RegionTraffic {
+  // The function offloaded: the outlined function of the region, or its
+  // batch wrapper if the region is offloaded in batches.
+  std::string function;
+  std::size_t calls = 0;
+  std::uint64_t loadBytes = 0;
+  std::uint64_t storeBytes = 0;
+  std::uint64_t commBytes = 0;
+};
+
+struct SimulationReport {
+  SimulatedRun original;
+  SimulatedRun outlined;
+  // Offloaded traffic of the outlined run per offloaded function, in module
+  // order.
+  std::vector<RegionTraffic> regions;
+  bool resultsMatch = false;
+  // Estimated time of the original run entirely on the host and of the
+  // outlined run with its offloads on the NDP.
+  double hostSeconds = 0;
+  double offloadSeconds = 0;
+  double speedup = 0;
+};
+
+// Runs the exported entry point of both modules under the interpreter,
+// arguments not given are zero. Offload calls run in the same instance, comm
+// blocks come from pages the simulator adds with memory.grow, so the guest's
+// own allocator never reuses them (and sees memory.size grow). Throws
+// std::runtime_error if either run traps.
+SimulationReport simulateOffload(wasm::Module& original,
+                                 wasm::Module& outlined,
+                                 std::string_view entry,
+                                 const wasm::Literals& args = {},
+                                 const LinkModel& link = {});
+
+// Writes the module as text. Whether binaryen's printer adds color codes is
+// a process-wide setting, callers turn them off once before writing from any
+// thread (Colors::setEnabled(false)).
+void writeWat(wasm::Module& wmod,
+              const std::filesystem::path& outPath,
+              Stats* stats = nullptr);
+
+struct BinaryOptions {
+  // Emit the names section.
+  bool debugInfo = false;
+  // Receives the source map of the output when set.
+  std::string* sourceMap = nullptr;
+  // Recorded in the module's sourceMappingURL section with sourceMap.
+  std::string sourceMapUrl;
+};
+
+// Replaces the contents of out with the binary encoding of the module.
+void writeBinary(wasm::Module& wmod,
+                 std::vector<std::byte>& out,
+                 const BinaryOptions& options = {},
+                 Stats* stats = nullptr);
+
+void writeBinary(wasm::Module& wmod,
+                 const std::filesystem::path& outPath,
+                 const BinaryOptions& options = {},
+                 Stats* stats = nullptr);
 
 } // namespace wndpe
 
@@ -0,0 +1,276 @@
+#include "bench/SyntheticModule.h"
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <wasm-builder.h>
+
+#include <fmt/core.h>
+
+#include "wndpe/Intrinsics.h"
+
+namespace wndpe::bench {
+
+using namespace wasm;
+
+namespace {
+
+// Locals of every synthetic function.
+constexpr Index PtrLocal = 0;
+constexpr Index CountLocal = 1;
+constexpr Index IndexLocal = 2;
+constexpr Index AccLocal = 3;
+constexpr Index TmpLocal = 4;
+constexpr Index AddrLocal = 5;
+
+class FunctionGenerator {
+public:
+  FunctionGenerator(Module& wasm,
+                    const SyntheticOptions& options,
+                    std::mt19937& rng)
+    : builder(wasm), options(options), rng(rng) {}
+
+  std::unique_ptr<Function> make(Name name, bool marked) {
+    this->marked = marked;
+    std::vector<Expression*> body;
+    for (int i = 0; i < 2; i++) {
+      body.push_back(makeStatement());
+    }
+    CfgShape shape = options.shape;
+    if (shape == CfgShape::Mixed) {
+      shape = CfgShape(pick(3));
+    }
+    switch (shape) {
+      case CfgShape::Straight:
+        addRegion(body, makeStatements(options.regionSize));
+        break;
+      case CfgShape::Branchy:
+        addRegion(body, {makeBranches()});
+        break;
+      case CfgShape::Loop:
+      case CfgShape::Mixed:
+        if (pick(2) == 0) {
+          addRegion(body, {makeCountedLoop()});
+        } else {
+          body.push_back(makeRegionLoop());
+        }
+        break;
+    }
+    body.push_back(builder.makeLocalGet(AccLocal, Type::i32));
+
+    std::vector<NameType> params;
+    params.emplace_back("ptr", Type::i32);
+    params.emplace_back("n", Type::i32);
+    std::vector<NameType> vars;
+    vars.emplace_back("i", Type::i32);
+    vars.emplace_back("acc", Type::i32);
+    vars.emplace_back("tmp", Type::i32);
+    vars.emplace_back("addr", Type::i32);
+    return builder.makeFunction(
+      name,
+      std::move(params),
+      Signature(Type{Type::i32, Type::i32}, Type::i32),
+      std::move(vars),
+      builder.makeBlock(body, Type::i32));
+  }
+
+private:
+  unsigned pick(unsigned count) {
+    return std::uniform_int_distribution<unsigned>(0, count - 1)(rng);
+  }
+
+  Expression* getLocal(Index local) {
+    return builder.makeLocalGet(local, Type::i32);
+  }
+
+  Expression* makeConst(int32_t value) {
+    return builder.makeConst(Literal(value));
+  }
+
+  // One load, store or arithmetic statement on the function's locals.
+  Expression* makeStatement() {
+    uint32_t offset = pick(256) * 4;
+    switch (pick(4)) {
+      case 0:
+        return builder.makeLocalSet(
+          AccLocal,
+          builder.makeBinary(
+            AddInt32,
+            getLocal(AccLocal),
+            builder.makeLoad(
+              4, false, offset, 4, getLocal(PtrLocal), Type::i32)));
+      case 1:
+        return builder.makeStore(
+          4, offset, 4, getLocal(PtrLocal), getLocal(AccLocal), Type::i32);
+      case 2:
+        return builder.makeLocalSet(
+          TmpLocal,
+          builder.makeBinary(MulInt32,
+                             getLocal(AccLocal),
+                             makeConst(int32_t(pick(1000)) | 1)));
+      default:
+        return builder.makeLocalSet(
+          AccLocal,
+          builder.makeBinary(XorInt32, getLocal(AccLocal), getLocal(TmpLocal)));
+    }
+  }
+
+  std::vector<Expression*> makeStatements(std::size_t count) {
+    std::vector<Expression*> list;
+    for (std::size_t i = 0; i < count; i++) {
+      list.push_back(makeStatement());
+    }
+    return list;
+  }
+
+  // Wraps code in markers if the function is marked.
+  void addRegion(std::vector<Expression*>& body,
+                 const std::vector<Expression*>& code) {
+    if (marked) {
+      body.push_back(makeMarker(IntrinsicOutlineBegin));
+    }
+    body.insert(body.end(), code.begin(), code.end());
+    if (marked) {
+      body.push_back(makeMarker(IntrinsicOutlineEnd));
+    }
+  }
+
+  Expression* makeMarker(Name intrinsic) {
+    return builder.makeCall(intrinsic, {}, Type::none);
+  }
+
+  // if (acc & 1) {...} else if (acc & 2) {...} else {...}
+  Expression* makeBranches() {
+    std::size_t size = std::max<std::size_t>(options.regionSize / 3, 1);
+    auto makeTest = [&](int32_t bit) {
+      return builder.makeBinary(AndInt32, getLocal(AccLocal), makeConst(bit));
+    };
+    return builder.makeIf(
+      makeTest(1),
+      builder.makeBlock(makeStatements(size)),
+      builder.makeIf(makeTest(2),
+                     builder.makeBlock(makeStatements(size)),
+                     builder.makeBlock(makeStatements(size))));
+  }
+
+  // for (i = 0; i < n; i++) {...}
+  Expression* makeCountedLoop() {
+    Name done = "done";
+    Name loop = "loop";
+    std::vector<Expression*> loopBody;
+    loopBody.push_back(builder.makeBreak(
+      done,
+      nullptr,
+      builder.makeBinary(
+        GeUInt32, getLocal(IndexLocal), getLocal(CountLocal))));
+    for (Expression* statement : makeStatements(options.regionSize)) {
+      loopBody.push_back(statement);
+    }
+    loopBody.push_back(makeIncrement());
+    loopBody.push_back(builder.makeBreak(loop));
+    return builder.makeSequence(
+      builder.makeLocalSet(IndexLocal, makeConst(0)),
+      builder.makeBlock(done,
+                        builder.makeLoop(loop, builder.makeBlock(loopBody))));
+  }
+
+  // do { <region: ptr[i] *= c> } while (++i < n), the shape offloads are
+  // batched for.
+  Expression* makeRegionLoop() {
+    Name loop = "loop";
+    std::vector<Expression*> region;
+    region.push_back(builder.makeLocalSet(
+      AddrLocal,
+      builder.makeBinary(
+        AddInt32,
+        getLocal(PtrLocal),
+        builder.makeBinary(ShlInt32, getLocal(IndexLocal), makeConst(2)))));
+    for (std::size_t i = 0; i < options.regionSize; i++) {
+      uint32_t offset = i * 4;
+      region.push_back(builder.makeStore(
+        4,
+        offset,
+        4,
+        getLocal(AddrLocal),
+        builder.makeBinary(
+          MulInt32,
+          builder.makeLoad(4, false, offset, 4, getLocal(AddrLocal), Type::i32),
+          makeConst(int32_t(pick(1000)) | 1)),
+        Type::i32));
+    }
+    std::vector<Expression*> loopBody;
+    addRegion(loopBody, region);
+    loopBody.push_back(makeIncrement());
+    loopBody.push_back(builder.makeBreak(
+      loop,
+      nullptr,
+      builder.makeBinary(
+        LtUInt32, getLocal(IndexLocal), getLocal(CountLocal))));
+    return builder.makeLoop(loop, builder.makeBlock(loopBody));
+  }
+
+  Expression* makeIncrement() {
+    return builder.makeLocalSet(
+      IndexLocal,
+      builder.makeBinary(AddInt32, getLocal(IndexLocal), makeConst(1)));
+  }
+
+  Builder builder;
+  const SyntheticOptions& options;
+  std::mt19937& rng;
+  bool marked = false;
+};
+
+} // namespace
+
+CfgShape parseCfgShape(std::string_view name) {
+  for (CfgShape shape : {CfgShape::Straight,
+                         CfgShape::Branchy,
+                         CfgShape::Loop,
+                         CfgShape::Mixed}) {
+    if (name == getCfgShapeName(shape)) {
+      return shape;
+    }
+  }
+  throw std::invalid_argument(fmt::format("Unknown CFG shape {}", name));
+}
+
+std::string_view getCfgShapeName(CfgShape shape) {
+  switch (shape) {
+    case CfgShape::Straight:
+      return "straight";
+    case CfgShape::Branchy:
+      return "branchy";
+    case CfgShape::Loop:
+      return "loop";
+    case CfgShape::Mixed:
+      return "mixed";
+  }
+  return "unknown";
+}
+
+std::unique_ptr<Module> makeSyntheticModule(const SyntheticOptions& options) {
+  auto wasm = std::make_unique<Module>();
+  wasm->memory.exists = true;
+  wasm->memory.initial = 1;
+  for (Name marker : {IntrinsicOutlineBegin, IntrinsicOutlineEnd}) {
+    auto import =
+      Builder::makeFunction(marker, Signature(Type::none, Type::none), {});
+    import->module = IntrinsicsModule;
+    import->base = marker;
+    wasm->addFunction(std::move(import));
+  }
+
+  std::mt19937 rng(options.seed);
+  std::bernoulli_distribution isMarked(options.markerDensity);
+  FunctionGenerator generator(*wasm, options, rng);
+  for (std::size_t i = 0; i < options.functions; i++) {
+    wasm->addFunction(
+      generator.make(fmt::format("f{}", i), isMarked(rng)));
+  }
+  return wasm;
+}
+
+} // namespace wndpe::bench
@@ -0,0 +1,45 @@
+#ifndef WNDPE_BENCH_SYNTHETICMODULE_H_INCLUDED
+#define WNDPE_BENCH_SYNTHETICMODULE_H_INCLUDED 1
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+#include <wasm.h>
+
+namespace wndpe::bench {
+
+// Control flow around the marked regions of a synthetic function.
+enum class CfgShape {
+  // The region is a run of statements in the function body.
+  Straight,
+  // The region is an if/else chain.
+  Branchy,
+  // The region is a counted loop, or the body of one.
+  Loop,
+  // A random one of the above per function.
+  Mixed,
+};
+
+struct SyntheticOptions {
+  std::size_t functions = 1000;
+  // Fraction of functions with a marked region.
+  double markerDensity = 0.1;
+  CfgShape shape = CfgShape::Mixed;
+  // Statements in a region, each a load, a store or arithmetic on locals.
+  std::size_t regionSize = 8;
+  std::uint32_t seed = 1;
+};
+
+// Parses straight, branchy, loop or mixed. Throws std::invalid_argument.
+CfgShape parseCfgShape(std::string_view name);
+std::string_view getCfgShapeName(CfgShape shape);
+
+// Builds a valid module of options.functions functions taking a pointer and
+// a count and returning an i32, the same for the same options.
+std::unique_ptr<wasm::Module>
+makeSyntheticModule(const SyntheticOptions& options);
+
+} // namespace wndpe::bench
+
+#endif
@@ -0,0 +1,553 @@
+#include "bench/SyntheticModule.h"
+#include "driver/WorkPool.h"
+#include "wndpe/wndpe.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#include <stdlib.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <fmt/core.h>
+
+namespace fs = std::filesystem;
+
+// Runs one row of the scaling run: the bench re-executes itself with this
+// option, so every row gets a fresh binaryen thread pool sized by
+// BINARYEN_CORES and a peak RSS of its own.
+constexpr std::string_view SCALING_ROW_OPTION = "--scaling-row";
+
+using wndpe::bench::CfgShape;
+using wndpe::bench::SyntheticOptions;
+
+struct BenchOptions {
+  // Module sizes to measure, ascending.
+  std::vector<std::size_t> sizes;
+  SyntheticOptions synthetic;
+  // Thread counts of the scaling run, empty to skip it.
+  std::vector<unsigned> threads;
+  // Functions in each module of the scaling run.
+  std::size_t scalingFunctions = 2000;
+  // Empty: no JSON report.
+  fs::path jsonPath;
+  bool verbose = false;
+};
+
+// One load, outline and write of a module.
+struct SizeResult {
+  std::size_t functions = 0;
+  std::size_t inputBytes = 0;
+  std::size_t outputBytes = 0;
+  wndpe::Stats stats;
+};
+
+struct ScalingResult {
+  // Both the WorkPool size and binaryen's core count.
+  unsigned threads = 0;
+  // Concurrent modules of the scaling size.
+  std::size_t modules = 0;
+  double seconds = 0;
+  // One module of the largest measured size on its own.
+  double largeSeconds = 0;
+  // Of the process running the row, which doesn't generate any module.
+  std::uint64_t peakRssBytes = 0;
+};
+
+void printUsage(const char* argv0) {
+  fmt::print(
+    stdout,
+    "Usage: {} [options]\n"
+    "\n"
+    "Measures the extractor on synthetic modules: load, outlining and write\n"
+    "throughput per module size, peak memory, and throughput of concurrent\n"
+    "modules per thread count.\n"
+    "\n"
+    "Options:\n"
+    "  --functions N         Module size to measure, repeat for several\n"
+    "                        (default: 500, 5000, 50000)\n"
+    "  --density X           Fraction of functions with a marked region\n"
+    "                        (default: {})\n"
+    "  --shape S             Control flow around the regions: straight,\n"
+    "                        branchy, loop or mixed (default: {})\n"
+    "  --region-size N       Statements per region (default: {})\n"
+    "  --seed N              Random seed of the generator (default: {})\n"
+    "  --threads N           Thread count of the scaling run, repeat for\n"
+    "                        several, 0 to skip it (default: 1, 2, 4, ...\n"
+    "                        up to the hardware threads). Each count runs\n"
+    "                        in its own process with BINARYEN_CORES set\n"
+    "                        to it, on concurrent modules and on one\n"
+    "                        module of the largest --functions size\n"
+    "  --scaling-functions N Functions per module in the scaling run\n"
+    "                        (default: {})\n"
+    "  --json FILE           Also write the results to FILE as JSON\n"
+    "  -v, --verbose         Print the library's diagnostics\n"
+    "  -h, --help            Show this help\n",
+    argv0,
+    SyntheticOptions{}.markerDensity,
+    getCfgShapeName(SyntheticOptions{}.shape),
+    SyntheticOptions{}.regionSize,
+    SyntheticOptions{}.seed,
+    BenchOptions{}.scalingFunctions);
+}
+
+[[noreturn]] void usageError(const std::string& message) {
+  fmt::print(stderr, "{}\nSee --help for usage.\n", message);
+  std::exit(2);
+}
+
+BenchOptions parseArguments(int argc, char** argv) {
+  BenchOptions options;
+  bool skipScaling = false;
+  auto value = [&](int& i) -> std::string {
+    if (i + 1 >= argc) {
+      usageError(fmt::format("Missing value for {}", argv[i]));
+    }
+    return argv[++i];
+  };
+  auto number = [&](int& i, unsigned long max) -> unsigned long {
+    std::string arg = argv[i];
+    std::string text = value(i);
+    unsigned long result = 0;
+    try {
+      result = std::stoul(text);
+    } catch (const std::invalid_argument&) {
+      usageError(fmt::format("Invalid number for {}: {}", arg, text));
+    } catch (const std::out_of_range&) {
+      result = std::numeric_limits<unsigned long>::max();
+    }
+    if (text.find('-') != std::string::npos || result > max) {
+      usageError(fmt::format(
+        "Number for {} out of range 0..{}: {}", arg, max, text));
+    }
+    return result;
+  };
+  auto real = [&](int& i) -> double {
+    std::string arg = argv[i];
+    std::string text = value(i);
+    try {
+      return std::stod(text);
+    } catch (const std::exception&) {
+      usageError(fmt::format("Invalid number for {}: {}", arg, text));
+    }
+  };
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      printUsage(argv[0]);
+      std::exit(0);
+    } else if (arg == "--functions") {
+      options.sizes.push_back(
+        number(i, std::numeric_limits<std::size_t>::max()));
+    } else if (arg == "--density") {
+      options.synthetic.markerDensity = std::clamp(real(i), 0.0, 1.0);
+    } else if (arg == "--shape") {
+      std::string name = value(i);
+      try {
+        options.synthetic.shape = wndpe::bench::parseCfgShape(name);
+      } catch (const std::invalid_argument& e) {
+        usageError(e.what());
+      }
+    } else if (arg == "--region-size") {
+      options.synthetic.regionSize = std::max<unsigned long>(
+        number(i, std::numeric_limits<std::size_t>::max()), 1);
+    } else if (arg == "--seed") {
+      options.synthetic.seed =
+        number(i, std::numeric_limits<std::uint32_t>::max());
+    } else if (arg == "--threads") {
+      unsigned threads = number(i, std::numeric_limits<unsigned>::max());
+      if (threads == 0) {
+        skipScaling = true;
+      } else {
+        options.threads.push_back(threads);
+      }
+    } else if (arg == "--scaling-functions") {
+      options.scalingFunctions =
+        number(i, std::numeric_limits<std::size_t>::max());
+    } else if (arg == "--json") {
+      options.jsonPath = value(i);
+    } else if (arg == "-v" || arg == "--verbose") {
+      options.verbose = true;
+    } else {
+      usageError(fmt::format("Unknown option {}", arg));
+    }
+  }
+  if (options.sizes.empty()) {
+    options.sizes = {500, 5000, 50000};
+  }
+  // Peak memory only grows, so it's only meaningful per size in this order.
+  std::sort(options.sizes.begin(), options.sizes.end());
+  if (skipScaling) {
+    options.threads.clear();
+  } else if (options.threads.empty()) {
+    unsigned hardware = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned threads = 1; threads < hardware; threads *= 2) {
+      options.threads.push_back(threads);
+    }
+    options.threads.push_back(hardware);
+  }
+  return options;
+}
+
+std::vector<std::byte> makeInput(const SyntheticOptions& synthetic) {
+  auto wmod = wndpe::bench::makeSyntheticModule(synthetic);
+  std::vector<std::byte> bytes;
+  wndpe::writeBinary(*wmod, bytes);
+  return bytes;
+}
+
+// The work the driver does per module, on a module held in memory.
+void processModule(std::span<const std::byte> input,
+                   std::vector<std::byte>& output,
+                   wndpe::Stats* stats) {
+  auto wmod = wndpe::loadModule(input, {}, stats);
+  wndpe::OutliningOptions outlining;
+  outlining.stats = stats;
+  wndpe::runOutliningPasses(*wmod, outlining);
+  wndpe::writeBinary(*wmod, output, {}, stats);
+}
+
+SizeResult measureSize(const BenchOptions& options, std::size_t functions) {
+  SyntheticOptions synthetic = options.synthetic;
+  synthetic.functions = functions;
+  std::vector<std::byte> input = makeInput(synthetic);
+  std::vector<std::byte> output;
+  SizeResult result;
+  result.functions = functions;
+  result.inputBytes = input.size();
+  processModule(input, output, &result.stats);
+  result.outputBytes = output.size();
+  return result;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+    .count();
+}
+
+std::vector<std::byte> readInput(const fs::path& path) {
+  std::ifstream in(path, std::ios::binary);
+  std::ostringstream contents;
+  if (!(in && contents << in.rdbuf())) {
+    throw std::runtime_error(fmt::format("{}: can't read", path.string()));
+  }
+  std::string text = contents.str();
+  auto* data = reinterpret_cast<const std::byte*>(text.data());
+  return std::vector<std::byte>(data, data + text.size());
+}
+
+void writeInput(const fs::path& path, std::span<const std::byte> input) {
+  std::ofstream out(path, std::ios::binary);
+  if (!(out.write(reinterpret_cast<const char*>(input.data()), input.size()) &&
+        out.flush())) {
+    throw std::runtime_error(fmt::format("{}: can't write", path.string()));
+  }
+}
+
+// The child side of a scaling row, binaryen's core count is already set by
+// the environment. Prints the seconds of the concurrent modules, the
+// seconds of the large module and the peak RSS.
+int runScalingRow(const char* threadsText,
+                  const char* inputPath,
+                  const char* largePath) {
+  wndpe::setLogLevel(wndpe::LogLevel::Quiet);
+  try {
+    unsigned threads = std::stoul(threadsText);
+    std::vector<std::byte> input = readInput(inputPath);
+    std::vector<std::byte> large = readInput(largePath);
+    std::vector<std::byte> largeOutput;
+    auto start = std::chrono::steady_clock::now();
+    processModule(large, largeOutput, nullptr);
+    double largeSeconds = secondsSince(start);
+
+    // Enough modules that every thread gets several and stealing evens out
+    // the tail.
+    std::size_t modules = std::size_t(threads) * 4;
+    std::atomic<bool> failed = false;
+    wndpe::WorkPool pool{threads};
+    start = std::chrono::steady_clock::now();
+    pool.run(modules, [&](std::size_t) {
+      std::vector<std::byte> output;
+      try {
+        processModule(input, output, nullptr);
+      } catch (const std::exception& e) {
+        fmt::print(stderr, "{}\n", e.what());
+        failed = true;
+      }
+    });
+    double seconds = secondsSince(start);
+    if (failed) {
+      return 1;
+    }
+    wndpe::Stats usage;
+    usage.samplePeakMemory();
+    fmt::print(stdout, "{} {} {}\n", seconds, largeSeconds, usage.peakRssBytes);
+  } catch (const std::exception& e) {
+    fmt::print(stderr, "{}\n", e.what());
+    return 1;
+  }
+  return 0;
+}
+
+// Process and environment functions of the scaling run, spelled the POSIX
+// or the MSVC way.
+#ifdef _WIN32
+// Windows paths can't contain double quotes.
+std::string shellQuote(std::string_view text) {
+  return fmt::format("\"{}\"", text);
+}
+
+void setEnvironment(const char* name, const std::string& value) {
+  _putenv_s(name, value.c_str());
+}
+
+// cmd /c strips the outer quotes of a command starting with one, so the
+// whole command gets another pair.
+FILE* openProcess(const std::string& command) {
+  return _popen(fmt::format("\"{}\"", command).c_str(), "r");
+}
+
+int closeProcess(FILE* child) { return _pclose(child); }
+
+int getProcessId() { return _getpid(); }
+#else
+std::string shellQuote(std::string_view text) {
+  std::string out = "'";
+  for (char c : text) {
+    if (c == '\'') {
+      out += "'\\''";
+    } else {
+      out += c;
+    }
+  }
+  return out + "'";
+}
+
+void setEnvironment(const char* name, const std::string& value) {
+  setenv(name, value.c_str(), 1);
+}
+
+FILE* openProcess(const std::string& command) {
+  return popen(command.c_str(), "r");
+}
+
+int closeProcess(FILE* child) { return pclose(child); }
+
+int getProcessId() { return getpid(); }
+#endif
+
+// Runs a scaling row in a child process with BINARYEN_CORES=threads.
+ScalingResult measureScaling(const char* argv0,
+                             const fs::path& inputPath,
+                             const fs::path& largePath,
+                             unsigned threads) {
+  ScalingResult result;
+  result.threads = threads;
+  result.modules = std::size_t(threads) * 4;
+  // Read by binaryen when the child creates its thread pool, the pool of
+  // this process already exists and keeps its size.
+  setEnvironment("BINARYEN_CORES", std::to_string(threads));
+  std::string command = fmt::format("{} {} {} {} {}",
+                                    shellQuote(argv0),
+                                    SCALING_ROW_OPTION,
+                                    threads,
+                                    shellQuote(inputPath.string()),
+                                    shellQuote(largePath.string()));
+  FILE* child = openProcess(command);
+  if (!child) {
+    throw std::runtime_error(fmt::format("Can't run {}", command));
+  }
+  std::string line;
+  char buffer[256];
+  while (std::fgets(buffer, sizeof(buffer), child)) {
+    line += buffer;
+  }
+  int status = closeProcess(child);
+  std::istringstream fields(line);
+  if (status != 0 ||
+      !(fields >> result.seconds >> result.largeSeconds >>
+        result.peakRssBytes)) {
+    throw std::runtime_error(
+      fmt::format("Scaling run with {} threads failed", threads));
+  }
+  return result;
+}
+
+double perSecond(double amount, double seconds) {
+  return seconds > 0 ? amount / seconds : 0;
+}
+
+double getPassSeconds(const wndpe::PhaseTimings& phases) {
+  return phases.candidates + phases.outlining + phases.dce;
+}
+
+void printSize(const SizeResult& result) {
+  const wndpe::PhaseTimings& phases = result.stats.phases;
+  double passSeconds = getPassSeconds(phases);
+  fmt::print(stdout,
+             "{:>7} functions, {} regions ({} batched), {:.1f} MiB in, "
+             "{:.1f} MiB out\n"
+             "  load     {:8.3f} s  {:8.1f} MiB/s (+{:.3f} s validation)\n"
+             "  outline  {:8.3f} s  {:8.0f} functions/s (cfg {:.3f} s, "
+             "copy {:.3f} s)\n"
+             "  write    {:8.3f} s  {:8.1f} MiB/s\n"
+             "  peak RSS {:.1f} MiB (whole bench process so far, including "
+             "the generated modules)\n",
+             result.functions,
+             result.stats.regions,
+             result.stats.batchedRegions,
+             result.inputBytes / 1048576.0,
+             result.outputBytes / 1048576.0,
+             phases.load,
+             perSecond(result.inputBytes / 1048576.0, phases.load),
+             phases.validate,
+             passSeconds,
+             perSecond(result.functions, passSeconds),
+             phases.cfg,
+             phases.copy,
+             phases.write,
+             perSecond(result.outputBytes / 1048576.0, phases.write),
+             result.stats.peakRssBytes / 1048576.0);
+}
+
+void printScaling(const std::vector<ScalingResult>& results,
+                  std::size_t largeFunctions) {
+  fmt::print(stdout,
+             "threads  modules  seconds  modules/s  speedup  "
+             "large s  speedup  peak RSS\n");
+  double base = perSecond(results[0].modules, results[0].seconds);
+  double largeBase = results[0].largeSeconds;
+  for (const ScalingResult& result : results) {
+    double throughput = perSecond(result.modules, result.seconds);
+    fmt::print(stdout,
+               "{:>7}  {:>7}  {:7.3f}  {:9.2f}  {:6.2f}x  {:7.3f}  {:6.2f}x  "
+               "{:5.1f} MiB\n",
+               result.threads,
+               result.modules,
+               result.seconds,
+               throughput,
+               base > 0 ? throughput / base : 0,
+               result.largeSeconds,
+               perSecond(largeBase, result.largeSeconds),
+               result.peakRssBytes / 1048576.0);
+  }
+  fmt::print(stdout,
+             "Each row runs in its own process with BINARYEN_CORES set to "
+             "its thread count;\n\"large\" is one module of {} functions, "
+             "peak RSS is the row's process.\n",
+             largeFunctions);
+}
+
+void writeJson(const fs::path& path,
+               const BenchOptions& options,
+               const std::vector<SizeResult>& sizes,
+               const std::vector<ScalingResult>& scaling) {
+  std::size_t largeFunctions = options.sizes.back();
+  std::ofstream out(path);
+  if (!out) {
+    throw std::runtime_error(
+      fmt::format("{}: can't open for writing", path.string()));
+  }
+  const SyntheticOptions& synthetic = options.synthetic;
+  out << fmt::format("{{\"density\":{},\"shape\":\"{}\",\"regionSize\":{},"
+                     "\"seed\":{},\"sizes\":[",
+                     synthetic.markerDensity,
+                     getCfgShapeName(synthetic.shape),
+                     synthetic.regionSize,
+                     synthetic.seed);
+  for (size_t i = 0; i < sizes.size(); i++) {
+    out << fmt::format(
+      "{}\n  {{\"functions\":{},\"inputBytes\":{},\"outputBytes\":{},"
+      "\"stats\":{}}}",
+      i == 0 ? "" : ",",
+      sizes[i].functions,
+      sizes[i].inputBytes,
+      sizes[i].outputBytes,
+      sizes[i].stats.toJson());
+  }
+  out << fmt::format(
+    "\n],\"scalingFunctions\":{},\"largeFunctions\":{},\"scaling\":[",
+    options.scalingFunctions,
+    largeFunctions);
+  for (size_t i = 0; i < scaling.size(); i++) {
+    out << fmt::format("{}\n  {{\"threads\":{},\"modules\":{},\"seconds\":{},"
+                       "\"largeSeconds\":{},\"peakRssBytes\":{}}}",
+                       i == 0 ? "" : ",",
+                       scaling[i].threads,
+                       scaling[i].modules,
+                       scaling[i].seconds,
+                       scaling[i].largeSeconds,
+                       scaling[i].peakRssBytes);
+  }
+  out << "\n]}\n";
+  if (!out.flush()) {
+    throw std::runtime_error(fmt::format("{}: can't write", path.string()));
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc == 5 && argv[1] == SCALING_ROW_OPTION) {
+    return runScalingRow(argv[2], argv[3], argv[4]);
+  }
+  BenchOptions options = parseArguments(argc, argv);
+  // The per-function messages of the library would swamp the results.
+  wndpe::setLogLevel(options.verbose ? wndpe::LogLevel::Info
+                                     : wndpe::LogLevel::Quiet);
+  std::vector<SizeResult> sizes;
+  std::vector<ScalingResult> scaling;
+  try {
+    for (std::size_t functions : options.sizes) {
+      sizes.push_back(measureSize(options, functions));
+      printSize(sizes.back());
+    }
+    if (!options.threads.empty()) {
+      // The rows load the modules from files, so they don't pay for (or
+      // count the memory of) generating them.
+      fs::path dir = fs::temp_directory_path() /
+                     fmt::format("wndpe_bench_{}", getProcessId());
+      fs::create_directories(dir);
+      fs::path inputPath = dir / "scaling.wasm";
+      fs::path largePath = dir / "large.wasm";
+      SyntheticOptions synthetic = options.synthetic;
+      synthetic.functions = options.scalingFunctions;
+      writeInput(inputPath, makeInput(synthetic));
+      synthetic.functions = options.sizes.back();
+      writeInput(largePath, makeInput(synthetic));
+      try {
+        for (unsigned threads : options.threads) {
+          scaling.push_back(
+            measureScaling(argv[0], inputPath, largePath, threads));
+        }
+      } catch (...) {
+        fs::remove_all(dir);
+        throw;
+      }
+      fs::remove_all(dir);
+      printScaling(scaling, options.sizes.back());
+    }
+    if (!options.jsonPath.empty()) {
+      writeJson(options.jsonPath, options, sizes, scaling);
+    }
+  } catch (const std::exception& e) {
+    fmt::print(stderr, "{}\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include "driver/WorkPool.h"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace wndpe {
+
+namespace {
+
+struct WorkQueue {
+  std::mutex mutex;
+  std::deque<std::size_t> jobs;
+
+  std::optional<std::size_t> popFront() {
+    std::lock_guard _l(mutex);
+    if (jobs.empty()) {
+      return std::nullopt;
+    }
+    std::size_t job = jobs.front();
+    jobs.pop_front();
+    return job;
+  }
+
+  std::optional<std::size_t> popBack() {
+    std::lock_guard _l(mutex);
+    if (jobs.empty()) {
+      return std::nullopt;
+    }
+    std::size_t job = jobs.back();
+    jobs.pop_back();
+    return job;
+  }
+};
+
+} // namespace
+
+WorkPool::WorkPool(unsigned threads) : numThreads(threads) {
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+void WorkPool::run(std::size_t count,
+                   const std::function<void(std::size_t)>& job) {
+  std::size_t workers = std::min<std::size_t>(numThreads, count);
+  if (workers <= 1) {
+    for (std::size_t i = 0; i < count; i++) {
+      job(i);
+    }
+    return;
+  }
+
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+  queues.reserve(workers);
+  for (std::size_t w = 0; w < workers; w++) {
+    queues.push_back(std::make_unique<WorkQueue>());
+  }
+  for (std::size_t i = 0; i < count; i++) {
+    queues[i % workers]->jobs.push_back(i);
+  }
+
+  // No jobs are added once the workers start, so a worker that finds every
+  // queue empty is done.
+  auto work = [&](std::size_t self) {
+    while (true) {
+      std::optional<std::size_t> next = queues[self]->popFront();
+      for (std::size_t offset = 1; !next && offset < workers; offset++) {
+        next = queues[(self + offset) % workers]->popBack();
+      }
+      if (!next) {
+        return;
+      }
+      job(*next);
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(workers - 1);
+  for (std::size_t w = 1; w < workers; w++) {
+    threads.emplace_back(work, w);
+  }
+  work(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+} // namespace wndpe
@@ -0,0 +1,32 @@
+#ifndef WNDPE_DRIVER_WORKPOOL_H_INCLUDED
+#define WNDPE_DRIVER_WORKPOOL_H_INCLUDED 1
+
+#include <cstddef>
+#include <functional>
+
+namespace wndpe {
+
+// Runs batches of independent jobs on a bounded number of threads.
+//
+// Jobs are dealt round-robin into one deque per worker. A worker takes jobs
+// from the front of its own deque and, once that runs dry, steals from the
+// back of the others, so a few slow modules don't leave the remaining
+// threads idle.
+class WorkPool {
+public:
+  // 0 picks the number of hardware threads.
+  explicit WorkPool(unsigned threads = 0);
+
+  unsigned size() const { return numThreads; }
+
+  // Calls job(i) for every i in [0, count) and waits for all of them. Jobs
+  // must not throw.
+  void run(std::size_t count, const std::function<void(std::size_t)>& job);
+
+private:
+  unsigned numThreads;
+};
+
+} // namespace wndpe
+
+#endif
@@ -1,54 +1,562 @@
+#include "driver/WorkPool.h"
 #include "wndpe/wndpe.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include <fmt/core.h>
+#include <support/colors.h>
 
 using std::cout, std::cerr, std::endl;
 
+namespace fs = std::filesystem;
+
+constexpr std::string_view TEST_DIR = "tests/outlining";
 constexpr std::string_view TEST_INPUT_EXT = ".input.wat";
 constexpr std::string_view TEST_OUTPUT_EXT = ".output.wat";
 constexpr std::string_view TEST_DEBUG_EXT = ".dbg.wat";
+constexpr std::string_view TEST_DEBUG_FOOTPRINT_EXT = ".dbg.footprint.json";
+constexpr std::string_view TEST_ERROR_EXT = ".error.txt";
+constexpr std::string_view OUTPUT_SUFFIX = ".out";
+constexpr std::string_view FOOTPRINT_EXT = ".footprint.json";
+
+struct DriverOptions {
+  std::vector<std::string> inputs;
+  // Empty: write each output next to its input.
+  fs::path outputDir;
+  // 0: one per hardware thread.
+  unsigned jobs = 0;
+  // Write binary modules instead of text.
+  bool binary = false;
+  wndpe::OutliningOptions outlining;
+  // Empty: no statistics are collected.
+  fs::path statsPath;
+  // Export run under the offload simulator, empty for none.
+  std::string simulateEntry;
+  wndpe::LinkModel link;
+  // Replace the golden outputs of the tests instead of comparing with them.
+  bool updateGolden = false;
+};
+
+struct ModuleJob {
+  fs::path input;
+  fs::path output;
+  // Memory footprint manifest of the outlined regions, empty for none.
+  fs::path footprint;
+  // Golden output the output is compared with, empty for none.
+  fs::path expected;
+  // Golden footprint manifest the footprint is compared with, empty for none.
+  fs::path expectedFootprint;
+  // Golden error message of a test that has to fail, empty for none.
+  fs::path expectedError;
+};
+
+void printUsage(const char* argv0) {
+  fmt::print(
+    stdout,
+    "Usage: {} [options] INPUT...\n"
+    "\n"
+    "Outlines the marked regions of wasm modules for near-data processing.\n"
+    "With no inputs, runs the outlining tests in {}.\n"
+    "\n"
+    "INPUT is a .wat/.wasm file, a directory (all .wat/.wasm files in it)\n"
+    "or a path whose file name contains * and ? wildcards.\n"
+    "\n"
+    "Options:\n"
+    "  -o, --output DIR      Directory to write the outputs to, by default\n"
+    "                        they go next to the inputs as <name>{}.wat\n"
+    "                        (or .wasm with --binary), plus the memory\n"
+    "                        footprint of the regions as <name>{}{}\n"
+    "  -j, --jobs N          Modules processed concurrently (default: one\n"
+    "                        per hardware thread)\n"
+    "  --binary              Write binary modules\n"
+    "  --auto                Mark offload candidates automatically\n"
+    "  --min-score X         Lowest candidate score to mark (default: {})\n"
+    "  --max-regions N       Candidates marked per module, 0 for no limit\n"
+    "  --cache DIR           Reuse the analysis of unchanged functions from\n"
+    "                        earlier runs, kept in DIR\n"
+    "  --batch N             Iterations per offload of regions forming a\n"
+    "                        loop body, 0 to offload each one (default: {})\n"
+    "  --no-pool             Allocate every comm block through the runtime\n"
+    "                        instead of the module's own pool\n"
+    "  --simulate EXPORT     Run EXPORT (zero arguments) before and after\n"
+    "                        outlining and estimate the offload speedup\n"
+    "  --link-latency S      Offload round trip in seconds (default: {})\n"
+    "  --link-bandwidth B    Link bandwidth in bytes/s (default: {})\n"
+    "  --stats FILE          Write per-module timings and counters to FILE\n"
+    "                        as JSON\n"
+    "  --update-golden       With no INPUT, write the test outputs to the\n"
+    "                        golden <name>{} and <name>{} files instead\n"
+    "                        of comparing\n"
+    "  -q, --quiet           Only print errors\n"
+    "  -v, --verbose         Print more diagnostics, repeat for even more\n"
+    "  -h, --help            Show this help\n",
+    argv0,
+    TEST_DIR,
+    OUTPUT_SUFFIX,
+    OUTPUT_SUFFIX,
+    FOOTPRINT_EXT,
+    wndpe::CandidateOptions{}.minScore,
+    wndpe::OutliningOptions{}.batchRecords,
+    wndpe::LinkModel{}.latencySeconds,
+    wndpe::LinkModel{}.linkBandwidth,
+    TEST_OUTPUT_EXT,
+    FOOTPRINT_EXT);
+}
+
+[[noreturn]] void usageError(const std::string& message) {
+  fmt::print(stderr, "{}\nSee --help for usage.\n", message);
+  std::exit(2);
+}
+
+DriverOptions parseArguments(int argc, char** argv) {
+  DriverOptions options;
+  auto value = [&](int& i) -> std::string {
+    if (i + 1 >= argc) {
+      usageError(fmt::format("Missing value for {}", argv[i]));
+    }
+    return argv[++i];
+  };
+  // Rejects negative numbers, which stoul would wrap, and ones above max.
+  auto number = [&](int& i, unsigned long max) -> unsigned long {
+    std::string arg = argv[i];
+    std::string text = value(i);
+    unsigned long result = 0;
+    try {
+      result = std::stoul(text);
+    } catch (const std::invalid_argument&) {
+      usageError(fmt::format("Invalid number for {}: {}", arg, text));
+    } catch (const std::out_of_range&) {
+      result = std::numeric_limits<unsigned long>::max();
+    }
+    if (text.find('-') != std::string::npos || result > max) {
+      usageError(fmt::format(
+        "Number for {} out of range 0..{}: {}", arg, max, text));
+    }
+    return result;
+  };
+  auto real = [&](int& i) -> double {
+    std::string arg = argv[i];
+    std::string text = value(i);
+    try {
+      return std::stod(text);
+    } catch (const std::exception&) {
+      usageError(fmt::format("Invalid number for {}: {}", arg, text));
+    }
+  };
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      printUsage(argv[0]);
+      std::exit(0);
+    } else if (arg == "-o" || arg == "--output") {
+      options.outputDir = value(i);
+    } else if (arg == "-j" || arg == "--jobs") {
+      options.jobs = number(i, std::numeric_limits<unsigned>::max());
+    } else if (arg == "--binary") {
+      options.binary = true;
+    } else if (arg == "--auto") {
+      options.outlining.autoDetect = true;
+    } else if (arg == "--min-score") {
+      options.outlining.candidates.minScore = real(i);
+    } else if (arg == "--simulate") {
+      options.simulateEntry = value(i);
+    } else if (arg == "--link-latency") {
+      options.link.latencySeconds = real(i);
+    } else if (arg == "--link-bandwidth") {
+      options.link.linkBandwidth = real(i);
+    } else if (arg == "--max-regions") {
+      options.outlining.candidates.maxRegions =
+        number(i, std::numeric_limits<std::size_t>::max());
+    } else if (arg == "--cache") {
+      options.outlining.cacheDir = value(i);
+    } else if (arg == "--batch") {
+      options.outlining.batchRecords =
+        number(i, std::numeric_limits<std::uint32_t>::max());
+    } else if (arg == "--no-pool") {
+      options.outlining.commPool = false;
+    } else if (arg == "--stats") {
+      options.statsPath = value(i);
+    } else if (arg == "--update-golden") {
+      options.updateGolden = true;
+    } else if (arg == "-q" || arg == "--quiet") {
+      wndpe::setLogLevel(wndpe::LogLevel::Quiet);
+    } else if (arg == "-v" || arg == "--verbose") {
+      int level = static_cast<int>(wndpe::getLogLevel());
+      wndpe::setLogLevel(static_cast<wndpe::LogLevel>(
+        std::min(level + 1, static_cast<int>(wndpe::LogLevel::Trace))));
+    } else if (arg.starts_with("-")) {
+      usageError(fmt::format("Unknown option {}", arg));
+    } else {
+      options.inputs.emplace_back(arg);
+    }
+  }
+  return options;
+}
+
+bool matchWildcard(std::string_view pattern, std::string_view name) {
+  if (pattern.empty()) {
+    return name.empty();
+  }
+  if (pattern.front() == '*') {
+    for (size_t skip = 0; skip <= name.size(); skip++) {
+      if (matchWildcard(pattern.substr(1), name.substr(skip))) {
+        return true;
+      }
+    }
+    return false;
+  }
+  if (name.empty() ||
+      (pattern.front() != '?' && pattern.front() != name.front())) {
+    return false;
+  }
+  return matchWildcard(pattern.substr(1), name.substr(1));
+}
 
-void runOutliningTests() {
-  namespace fs = std::filesystem;
-  fs::path dirPath{"tests/outlining"};
+bool isModuleFile(const fs::path& path) {
+  return path.extension() == ".wat" || path.extension() == ".wasm";
+}
+
+// Appends the module files named by one INPUT argument, sorted by path.
+void expandInput(const std::string& arg, std::vector<fs::path>& out) {
+  fs::path path{arg};
+  std::string pattern = path.filename().string();
+  std::vector<fs::path> found;
+  if (pattern.find_first_of("*?") != std::string::npos) {
+    fs::path dir =
+      path.has_parent_path() ? path.parent_path() : fs::path{"."};
+    if (!fs::is_directory(dir)) {
+      throw std::runtime_error(
+        fmt::format("{}: no such directory", dir.string()));
+    }
+    for (const auto& dent : fs::directory_iterator(dir)) {
+      if (dent.is_regular_file() &&
+          matchWildcard(pattern, dent.path().filename().string())) {
+        found.push_back(dent.path());
+      }
+    }
+    if (found.empty()) {
+      throw std::runtime_error(fmt::format("{}: no matching files", arg));
+    }
+  } else if (fs::is_directory(path)) {
+    for (const auto& dent : fs::directory_iterator(path)) {
+      if (dent.is_regular_file() && isModuleFile(dent.path())) {
+        found.push_back(dent.path());
+      }
+    }
+  } else if (fs::is_regular_file(path)) {
+    found.push_back(path);
+  } else {
+    throw std::runtime_error(fmt::format("{}: no such file", arg));
+  }
+  std::sort(found.begin(), found.end());
+  out.insert(out.end(), found.begin(), found.end());
+}
+
+std::vector<ModuleJob> planJobs(const DriverOptions& options) {
+  std::vector<fs::path> inputs;
+  for (const std::string& arg : options.inputs) {
+    expandInput(arg, inputs);
+  }
+  std::vector<ModuleJob> jobs;
+  std::set<fs::path> outputs;
+  for (const fs::path& input : inputs) {
+    fs::path name = input.stem();
+    name += OUTPUT_SUFFIX;
+    name += options.binary ? ".wasm" : ".wat";
+    fs::path output = options.outputDir.empty() ? input.parent_path() / name
+                                                : options.outputDir / name;
+    if (!outputs.insert(output).second) {
+      throw std::runtime_error(
+        fmt::format("More than one input would be written to {}",
+                    output.string()));
+    }
+    fs::path footprint = output;
+    footprint.replace_extension(FOOTPRINT_EXT);
+    jobs.push_back(ModuleJob{input, output, footprint});
+  }
+  return jobs;
+}
+
+void writeStats(const fs::path& path,
+                const std::vector<ModuleJob>& jobs,
+                const std::vector<wndpe::Stats>& stats) {
+  std::ofstream out(path);
+  if (!out) {
+    throw std::runtime_error(
+      fmt::format("{}: can't open for writing", path.string()));
+  }
+  out << "[";
+  for (size_t i = 0; i < jobs.size(); i++) {
+    // Paths are assumed to be free of control characters, which is all
+    // std::quoted doesn't escape the JSON way.
+    out << (i == 0 ? "" : ",") << "\n  {\"input\":"
+        << std::quoted(jobs[i].input.generic_string()) << ",\"stats\":"
+        << stats[i].toJson() << "}";
+  }
+  out << "\n]\n";
+}
+
+void printSimulation(const wndpe::SimulationReport& report) {
+  const wndpe::SimulatedRun& before = report.original;
+  const wndpe::SimulatedRun& after = report.outlined;
+  fmt::print(stdout,
+             "     original: {} B host, {} B in regions\n"
+             "     outlined: {} B host, {} B offloaded, {} calls, {} B comm\n",
+             before.hostLoadBytes + before.hostStoreBytes,
+             before.regionLoadBytes + before.regionStoreBytes,
+             after.hostLoadBytes + after.hostStoreBytes,
+             after.regionLoadBytes + after.regionStoreBytes,
+             after.offloadCalls,
+             after.commBytes);
+  for (const wndpe::RegionTraffic& region : report.regions) {
+    fmt::print(stdout,
+               "     {}: {} calls, {} B loaded, {} B stored, {} B comm\n",
+               region.function,
+               region.calls,
+               region.loadBytes,
+               region.storeBytes,
+               region.commBytes);
+  }
+  fmt::print(stdout,
+             "     estimated speedup {:.2f}x{}\n",
+             report.speedup,
+             report.resultsMatch ? "" : " (RESULTS DIFFER)");
+}
+
+std::string readFile(const fs::path& path) {
+  std::ifstream in(path, std::ios::binary);
+  std::ostringstream contents;
+  if (!(in && contents << in.rdbuf())) {
+    throw std::runtime_error(fmt::format("{}: can't read", path.string()));
+  }
+  return contents.str();
+}
+
+// Compares an output of a test with its golden file, or replaces the golden
+// file with it. A missing golden file fails the test if it is required.
+void checkGolden(const fs::path& output,
+                 const fs::path& expected,
+                 bool update,
+                 bool required) {
+  if (update) {
+    fs::copy_file(output, expected, fs::copy_options::overwrite_existing);
+    return;
+  }
+  if (!fs::exists(expected)) {
+    if (!required) {
+      return;
+    }
+    throw std::runtime_error(
+      fmt::format("golden output {} is missing, create it with "
+                  "--update-golden",
+                  expected.string()));
+  }
+  if (readFile(output) != readFile(expected)) {
+    throw std::runtime_error(fmt::format(
+      "output {} differs from {}", output.string(), expected.string()));
+  }
+}
+
+// A test with a golden error message has to fail with exactly that message,
+// or records its error as the golden one. Returns the failure of the test.
+std::optional<std::string> checkExpectedError(const ModuleJob& job,
+                                              std::optional<std::string> error,
+                                              bool update) {
+  if (update) {
+    if (error) {
+      std::ofstream out(job.expectedError);
+      if (!(out << *error << '\n' << std::flush)) {
+        return fmt::format("{}: can't write", job.expectedError.string());
+      }
+      fs::remove(job.expected);
+      fs::remove(job.expectedFootprint);
+    } else {
+      fs::remove(job.expectedError);
+    }
+    return std::nullopt;
+  }
+  if (!fs::exists(job.expectedError)) {
+    return error;
+  }
+  std::string expected = readFile(job.expectedError);
+  while (!expected.empty() && std::isspace((unsigned char)expected.back())) {
+    expected.pop_back();
+  }
+  if (!error) {
+    return fmt::format("expected to fail with: {}", expected);
+  }
+  if (*error != expected) {
+    return fmt::format("failed with: {}\nexpected: {}", *error, expected);
+  }
+  return std::nullopt;
+}
+
+// Processes every module on the pool. A failing module is reported and
+// skipped without affecting the others. Statistics are collected into stats
+// when it is not empty, one entry per job. Returns the number of failures.
+size_t processModules(const std::vector<ModuleJob>& jobs,
+                      const DriverOptions& options,
+                      std::vector<wndpe::Stats>& stats) {
+  wndpe::WorkPool pool{options.jobs};
+  std::vector<std::optional<std::string>> errors(jobs.size());
+  std::vector<std::optional<wndpe::SimulationReport>> simulations(jobs.size());
+  std::atomic<size_t> failures = 0;
+  pool.run(jobs.size(), [&](size_t i) {
+    const ModuleJob& job = jobs[i];
+    wndpe::Stats* moduleStats = stats.empty() ? nullptr : &stats[i];
+    wndpe::OutliningOptions outlining = options.outlining;
+    outlining.stats = moduleStats;
+    std::unique_ptr<wasm::Module> original;
+    if (!options.simulateEntry.empty()) {
+      outlining.originalModule = &original;
+    }
+    wndpe::OutliningReport report;
+    if (!job.footprint.empty()) {
+      outlining.report = &report;
+    }
+    try {
+      auto wmod = wndpe::loadModule(job.input, moduleStats);
+      wndpe::runOutliningPasses(*wmod, outlining);
+      if (options.binary) {
+        wndpe::writeBinary(*wmod, job.output, {}, moduleStats);
+      } else {
+        wndpe::writeWat(*wmod, job.output, moduleStats);
+      }
+      if (!report.regions.empty()) {
+        std::ofstream out(job.footprint);
+        if (!(out << report.toJson() << std::flush)) {
+          throw std::runtime_error(
+            fmt::format("{}: can't write", job.footprint.string()));
+        }
+      }
+      if (!job.expected.empty()) {
+        checkGolden(job.output, job.expected, options.updateGolden, true);
+      }
+      if (!job.expectedFootprint.empty()) {
+        if (!report.regions.empty()) {
+          checkGolden(job.footprint,
+                      job.expectedFootprint,
+                      options.updateGolden,
+                      false);
+        } else if (options.updateGolden) {
+          fs::remove(job.expectedFootprint);
+        } else if (fs::exists(job.expectedFootprint)) {
+          throw std::runtime_error(
+            fmt::format("no outlined regions, expected {}",
+                        job.expectedFootprint.string()));
+        }
+      }
+      if (original) {
+        simulations[i] = wndpe::simulateOffload(
+          *original, *wmod, options.simulateEntry, {}, options.link);
+      }
+    } catch (const std::exception& e) {
+      errors[i] = e.what();
+    }
+    if (!job.expectedError.empty()) {
+      errors[i] = checkExpectedError(
+        job, std::move(errors[i]), options.updateGolden);
+    }
+    if (errors[i]) {
+      failures++;
+    }
+  });
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (!errors[i]) {
+      if (wndpe::getLogLevel() == wndpe::LogLevel::Quiet) {
+        continue;
+      }
+      fmt::print(stdout,
+                 "OK   {} -> {}\n",
+                 jobs[i].input.string(),
+                 jobs[i].output.string());
+      if (simulations[i]) {
+        printSimulation(*simulations[i]);
+      }
+    } else {
+      fmt::print(stderr,
+                 "FAIL {}: {}\n",
+                 jobs[i].input.string(),
+                 *errors[i]);
+    }
+  }
+  return failures;
+}
+
+std::vector<ModuleJob> planOutliningTests() {
+  fs::path dirPath{TEST_DIR};
   if (!fs::is_directory(dirPath)) {
     fmt::print(stderr, "{} test directory not found.\n", dirPath.string());
     std::exit(1);
   }
+  std::vector<ModuleJob> jobs;
   for (const auto& dent : fs::directory_iterator(dirPath)) {
     std::string spath = dent.path().string();
     if (!dent.is_regular_file() || !spath.ends_with(TEST_INPUT_EXT)) {
       continue;
     }
-    fmt::print(stdout, "Test {}\n", spath);
-    std::string opath = spath;
-    opath.replace(spath.size() - TEST_INPUT_EXT.size(),
-                  TEST_INPUT_EXT.size(),
-                  TEST_DEBUG_EXT);
-    {
-      try {
-        auto wmod = wndpe::loadModule(dent.path());
-        wndpe::runOutliningPasses(*wmod);
-        wndpe::writeWat(*wmod, opath);
-      } catch (const std::exception& e) {
-        fmt::print(stderr,
-                   "Caught exception when processing {}: {}",
-                   dent.path().string(),
-                   e.what());
-        std::exit(1);
-      }
-    }
+    std::string stem = spath.substr(0, spath.size() - TEST_INPUT_EXT.size());
+    ModuleJob job{dent.path(),
+                  stem + std::string(TEST_DEBUG_EXT),
+                  stem + std::string(TEST_DEBUG_FOOTPRINT_EXT)};
+    job.expected = stem + std::string(TEST_OUTPUT_EXT);
+    job.expectedFootprint = stem + std::string(FOOTPRINT_EXT);
+    job.expectedError = stem + std::string(TEST_ERROR_EXT);
+    jobs.push_back(std::move(job));
   }
+  std::sort(jobs.begin(), jobs.end(), [](const auto& a, const auto& b) {
+    return a.input < b.input;
+  });
+  return jobs;
 }
 
 int main(int argc, char** argv) {
-  (void)argc;
-  (void)argv;
-  runOutliningTests();
+  DriverOptions options = parseArguments(argc, argv);
+  // Global in binaryen, so it's set before any module is written
+  // concurrently.
+  Colors::setEnabled(false);
+  if (options.inputs.empty()) {
+    // Test outputs are meant to be read.
+    options.binary = false;
+  }
+  std::vector<ModuleJob> jobs;
+  try {
+    jobs = options.inputs.empty() ? planOutliningTests() : planJobs(options);
+    if (!options.outputDir.empty()) {
+      fs::create_directories(options.outputDir);
+    }
+  } catch (const std::exception& e) {
+    fmt::print(stderr, "{}\n", e.what());
+    return 1;
+  }
+  std::vector<wndpe::Stats> stats(options.statsPath.empty() ? 0 : jobs.size());
+  size_t failures = processModules(jobs, options, stats);
+  if (!options.statsPath.empty()) {
+    try {
+      writeStats(options.statsPath, jobs, stats);
+    } catch (const std::exception& e) {
+      fmt::print(stderr, "{}\n", e.what());
+      return 1;
+    }
+  }
+  if (failures != 0) {
+    fmt::print(stderr, "{} of {} modules failed\n", failures, jobs.size());
+    return 1;
+  }
   return 0;
 }
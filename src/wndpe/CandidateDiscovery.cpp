@@ -0,0 +1,290 @@
+#include "wndpe/wndpe.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+
+#include <ir/branch-utils.h>
+#include <ir/find_all.h>
+#include <ir/module-utils.h>
+#include <wasm-builder.h>
+#include <wasm-traversal.h>
+
+#include "wndpe/Intrinsics.h"
+
+namespace wndpe {
+
+using namespace wasm;
+
+namespace {
+
+// Static stand-in for the trip count of a nested loop.
+constexpr double NestedLoopWeight = 8.0;
+// Comm block size at which the transfer cost halves the score.
+constexpr double LiveBytesScale = 64.0;
+
+struct ScoredLoop {
+  // The expression the markers go around: the loop, or the blocks around it
+  // that its exiting branches target.
+  Expression** slot;
+  Expression* root;
+  // Expressions enclosing root inside the function.
+  std::vector<Expression*> enclosing;
+  OffloadCandidate candidate;
+
+  bool overlaps(const ScoredLoop& other) const {
+    return root == other.root ||
+           std::find(enclosing.begin(), enclosing.end(), other.root) !=
+             enclosing.end() ||
+           std::find(other.enclosing.begin(),
+                     other.enclosing.end(),
+                     root) != other.enclosing.end();
+  }
+};
+
+bool isMemoryOp(Expression* curr) {
+  return curr->is<Load>() || curr->is<Store>() || curr->is<AtomicRMW>() ||
+         curr->is<AtomicCmpxchg>() || curr->is<SIMDLoad>() ||
+         curr->is<SIMDLoadStoreLane>() || curr->is<MemoryCopy>() ||
+         curr->is<MemoryFill>();
+}
+
+// Collects the static memory profile of one loop.
+struct LoopScanner
+  : public ExpressionStackWalker<LoopScanner,
+                                 UnifiedExpressionVisitor<LoopScanner>> {
+  Function* func;
+  Loop* loop;
+  // Locals assigned from a value that reads memory, loads through them are
+  // counted as pointer chasing.
+  std::unordered_set<Index> loadDerived;
+  std::unordered_set<Index> accessed;
+  OffloadCandidate& out;
+  bool shippable = true;
+
+  LoopScanner(Function* func, Loop* loop, OffloadCandidate& out)
+    : func(func), loop(loop), out(out) {}
+
+  // Both instruction and memory operation counts are weighted, so the
+  // density of a loop nest stays a fraction of its instructions.
+  double nestingWeight() const {
+    int depth = 0;
+    for (Expression* e : expressionStack) {
+      if (e->is<Loop>() && e != loop) {
+        depth++;
+      }
+    }
+    return std::pow(NestedLoopWeight, depth);
+  }
+
+  bool isChased(Expression* ptr) const {
+    if (!FindAll<Load>(ptr).list.empty()) {
+      return true;
+    }
+    for (LocalGet* get : FindAll<LocalGet>(ptr).list) {
+      if (loadDerived.count(get->index)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void noteLocal(Index index) {
+    if (accessed.insert(index).second) {
+      Type type = func->getLocalType(index);
+      if (type.isNumber()) {
+        out.liveBytes += type.getByteSize();
+      } else {
+        shippable = false;
+      }
+    }
+  }
+
+  void visitExpression(Expression* curr) {
+    double weight = nestingWeight();
+    out.instructions += weight;
+    if (auto* get = curr->dynCast<LocalGet>()) {
+      noteLocal(get->index);
+    } else if (auto* set = curr->dynCast<LocalSet>()) {
+      noteLocal(set->index);
+    }
+    if (!isMemoryOp(curr)) {
+      return;
+    }
+    out.memoryOps += weight;
+    if (auto* load = curr->dynCast<Load>(); load && isChased(load->ptr)) {
+      out.chasedLoads += weight;
+    }
+  }
+
+  void run(Expression* root) {
+    for (LocalSet* set : FindAll<LocalSet>(root).list) {
+      if (!FindAll<Load>(set->value).list.empty()) {
+        loadDerived.insert(set->index);
+      }
+    }
+    walk(root);
+  }
+};
+
+// Memory density, boosted by pointer chasing (latency bound on the host,
+// cheap next to the memory) and discounted by the state that has to be
+// shipped.
+double scoreCandidate(const OffloadCandidate& c) {
+  if (c.instructions == 0 || c.memoryOps == 0) {
+    return 0;
+  }
+  double density = c.memoryOps / c.instructions;
+  double chasing = c.chasedLoads / c.memoryOps;
+  return density * (1 + chasing) * std::log2(1 + c.memoryOps) /
+         (1 + c.liveBytes / LiveBytesScale);
+}
+
+struct LoopCollector : public PostWalker<LoopCollector> {
+  Function* func;
+  std::vector<ScoredLoop>& loops;
+  // Slots of the expression being visited and of everything around it.
+  std::vector<Expression**> slotStack;
+
+  LoopCollector(Function* func, std::vector<ScoredLoop>& loops)
+    : func(func), loops(loops) {}
+
+  static void doPreVisit(LoopCollector* self, Expression** currp) {
+    self->slotStack.push_back(currp);
+  }
+
+  static void doPostVisit(LoopCollector* self, Expression** currp) {
+    self->slotStack.pop_back();
+  }
+
+  static void scan(LoopCollector* self, Expression** currp) {
+    self->pushTask(doPostVisit, currp);
+    PostWalker<LoopCollector>::scan(self, currp);
+    self->pushTask(doPreVisit, currp);
+  }
+
+  void visitLoop(Loop* curr) {
+    if (curr->type != Type::none) {
+      return;
+    }
+    // The region has to be left through its end (or by returning). Loops
+    // exiting with a branch, like the usual
+    //   (block $done (loop $l (br_if $done ...) ... (br $l)))
+    // are taken together with the blocks their branches leave to.
+    size_t root = slotStack.size() - 1;
+    while (!BranchUtils::getExitingBranches(*slotStack[root]).empty()) {
+      if (root == 0 || !(*slotStack[root - 1])->is<Block>()) {
+        return;
+      }
+      root--;
+    }
+    if ((*slotStack[root])->type != Type::none) {
+      return;
+    }
+    // The outlining pass would reject the region: a tail call can't leave an
+    // outlined function, and a marker inside a try body can throw to a catch
+    // outside the region.
+    if (hasTailCall(*slotStack[root])) {
+      return;
+    }
+    for (size_t i = 0; i < root; i++) {
+      auto* tryy = (*slotStack[i])->dynCast<Try>();
+      if (tryy && slotStack[i + 1] == &tryy->body) {
+        return;
+      }
+    }
+    ScoredLoop scored{slotStack[root], *slotStack[root], {}, {}};
+    for (size_t i = 0; i < root; i++) {
+      scored.enclosing.push_back(*slotStack[i]);
+    }
+    scored.candidate.function = func->name.c_str();
+    if (curr->name.is()) {
+      scored.candidate.label = curr->name.c_str();
+    }
+    LoopScanner scanner(func, curr, scored.candidate);
+    scanner.run(scored.root);
+    if (!scanner.shippable) {
+      return;
+    }
+    scored.candidate.score = scoreCandidate(scored.candidate);
+    loops.push_back(std::move(scored));
+  }
+};
+
+} // namespace
+
+std::vector<OffloadCandidate>
+markOffloadCandidates(wasm::Module& wmod, const CandidateOptions& options) {
+  ModuleUtils::ParallelFunctionAnalysis<std::vector<ScoredLoop>> analysis(
+    wmod, [&](Function* func, std::vector<ScoredLoop>& loops) {
+      if (func->imported() || hasOutliningMarkers(func)) {
+        return;
+      }
+      Type results = func->getResults();
+      if (results != Type::none && !results.isNumber()) {
+        return;
+      }
+      LoopCollector collector(func, loops);
+      collector.walk(func->body);
+    });
+
+  // Regions can't nest, so each function contributes its best loops that
+  // don't contain one another. Ties are broken by module order so the result
+  // is deterministic.
+  auto byScore = [](const ScoredLoop& a, const ScoredLoop& b) {
+    return a.candidate.score > b.candidate.score;
+  };
+  std::vector<ScoredLoop> best;
+  std::vector<ScoredLoop> others;
+  for (auto& func : wmod.functions) {
+    auto& loops = analysis.map[func.get()];
+    std::stable_sort(loops.begin(), loops.end(), byScore);
+    size_t firstPicked = best.size();
+    for (ScoredLoop& loop : loops) {
+      bool eligible = loop.candidate.score >= options.minScore &&
+                      (options.maxRegionsPerFunction == 0 ||
+                       best.size() - firstPicked <
+                         options.maxRegionsPerFunction) &&
+                      std::none_of(best.begin() + firstPicked,
+                                   best.end(),
+                                   [&](const ScoredLoop& picked) {
+                                     return picked.overlaps(loop);
+                                   });
+      (eligible ? best : others).push_back(std::move(loop));
+    }
+  }
+  std::stable_sort(best.begin(), best.end(), byScore);
+
+  Builder builder(wmod);
+  size_t marked = 0;
+  for (ScoredLoop& loop : best) {
+    if (options.maxRegions != 0 && marked >= options.maxRegions) {
+      break;
+    }
+    if (marked == 0) {
+      ensureIntrinsicImport(wmod, IntrinsicOutlineBegin);
+      ensureIntrinsicImport(wmod, IntrinsicOutlineEnd);
+    }
+    *loop.slot = builder.makeBlock(
+      {builder.makeCall(IntrinsicOutlineBegin, {}, Type::none),
+       *loop.slot,
+       builder.makeCall(IntrinsicOutlineEnd, {}, Type::none)});
+    loop.candidate.marked = true;
+    marked++;
+  }
+
+  std::vector<OffloadCandidate> report;
+  report.reserve(best.size() + others.size());
+  for (auto* list : {&best, &others}) {
+    for (ScoredLoop& loop : *list) {
+      report.push_back(std::move(loop.candidate));
+    }
+  }
+  std::stable_sort(
+    report.begin(), report.end(), [](const auto& a, const auto& b) {
+      return a.score > b.score;
+    });
+  return report;
+}
+
+} // namespace wndpe
@@ -0,0 +1,169 @@
+#include "wndpe/CommBlock.h"
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <stdexcept>
+
+#include <fmt/core.h>
+
+namespace wasm {
+
+CommBlockLayout CommBlockLayout::pack(Function* func,
+                                      const std::vector<Index>& inputs,
+                                      const std::vector<Index>& outputs,
+                                      bool hasResult) {
+  std::map<Index, CommSlot> byLocal;
+  auto note = [&](Index local) -> CommSlot& {
+    auto [it, inserted] = byLocal.try_emplace(local);
+    if (inserted) {
+      Type type = func->getLocalType(local);
+      if (!type.isNumber()) {
+        throw std::runtime_error(
+          fmt::format("Local {} of {} has type {}, which can't be passed "
+                      "through the comm block",
+                      func->getLocalNameOrGeneric(local).c_str(),
+                      func->name.c_str(),
+                      type.toString()));
+      }
+      it->second.local = local;
+      it->second.type = type;
+    }
+    return it->second;
+  };
+  for (Index local : inputs) {
+    note(local).isInput = true;
+  }
+  for (Index local : outputs) {
+    note(local).isOutput = true;
+  }
+
+  CommBlockLayout layout;
+  layout.slots.reserve(byLocal.size() + 1);
+  Type results = func->getResults();
+  if (hasResult && results != Type::none) {
+    if (!results.isNumber()) {
+      throw std::runtime_error(
+        fmt::format("{} returns {}, which can't be passed through the comm "
+                    "block",
+                    func->name.c_str(),
+                    results.toString()));
+    }
+    CommSlot slot{};
+    slot.type = results;
+    slot.isResult = true;
+    layout.slots.push_back(slot);
+  }
+  for (auto& [local, slot] : byLocal) {
+    layout.slots.push_back(slot);
+  }
+  std::stable_sort(layout.slots.begin(),
+                   layout.slots.end(),
+                   [](const CommSlot& a, const CommSlot& b) {
+                     return a.type.getByteSize() > b.type.getByteSize();
+                   });
+  for (CommSlot& slot : layout.slots) {
+    uint32_t bytes = slot.type.getByteSize();
+    slot.offset = layout.size;
+    layout.size += bytes;
+    layout.align = std::max(layout.align, bytes);
+  }
+  layout.size = (layout.size + layout.align - 1) / layout.align * layout.align;
+  return layout;
+}
+
+const CommSlot* CommBlockLayout::getResultSlot() const {
+  for (const CommSlot& slot : slots) {
+    if (slot.isResult) {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+static bool isSelected(const CommSlot& slot, CommDirection direction) {
+  return direction == CommDirection::Inputs ? slot.isInput : slot.isOutput;
+}
+
+Expression* CommBlockLayout::makeSerialize(Builder& builder,
+                                           CommDirection direction,
+                                           Index ptrLocal,
+                                           Type ptrType,
+                                           Index localShift) const {
+  std::vector<Expression*> stores;
+  for (const CommSlot& slot : slots) {
+    if (!isSelected(slot, direction)) {
+      continue;
+    }
+    uint32_t bytes = slot.type.getByteSize();
+    Index local = slot.local + localShift;
+    stores.push_back(
+      builder.makeStore(bytes,
+                        slot.offset,
+                        bytes,
+                        builder.makeLocalGet(ptrLocal, ptrType),
+                        builder.makeLocalGet(local, slot.type),
+                        slot.type));
+  }
+  if (stores.empty()) {
+    return builder.makeNop();
+  }
+  return builder.makeBlock(stores);
+}
+
+Expression* CommBlockLayout::makeDeserialize(Builder& builder,
+                                             CommDirection direction,
+                                             Index ptrLocal,
+                                             Type ptrType,
+                                             Index localShift) const {
+  std::vector<Expression*> loads;
+  for (const CommSlot& slot : slots) {
+    if (!isSelected(slot, direction)) {
+      continue;
+    }
+    uint32_t bytes = slot.type.getByteSize();
+    loads.push_back(builder.makeLocalSet(
+      slot.local + localShift,
+      builder.makeLoad(bytes,
+                       false,
+                       slot.offset,
+                       bytes,
+                       builder.makeLocalGet(ptrLocal, ptrType),
+                       slot.type)));
+  }
+  if (loads.empty()) {
+    return builder.makeNop();
+  }
+  return builder.makeBlock(loads);
+}
+
+Expression* CommBlockLayout::makeResultStore(Builder& builder,
+                                             Index ptrLocal,
+                                             Type ptrType,
+                                             Expression* value) const {
+  const CommSlot* slot = getResultSlot();
+  assert(slot);
+  uint32_t bytes = slot->type.getByteSize();
+  return builder.makeStore(bytes,
+                           slot->offset,
+                           bytes,
+                           builder.makeLocalGet(ptrLocal, ptrType),
+                           value,
+                           slot->type);
+}
+
+Expression* CommBlockLayout::makeResultLoad(Builder& builder,
+                                            Index ptrLocal,
+                                            Type ptrType) const {
+  const CommSlot* slot = getResultSlot();
+  assert(slot);
+  uint32_t bytes = slot->type.getByteSize();
+  return builder.makeLoad(bytes,
+                          false,
+                          slot->offset,
+                          bytes,
+                          builder.makeLocalGet(ptrLocal, ptrType),
+                          slot->type);
+}
+
+} // namespace wasm
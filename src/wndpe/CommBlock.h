@@ -0,0 +1,79 @@
+#ifndef WNDPE_COMMBLOCK_H_INCLUDED
+#define WNDPE_COMMBLOCK_H_INCLUDED 1
+
+#include <cstdint>
+#include <vector>
+
+#include <wasm-builder.h>
+#include <wasm.h>
+
+namespace wasm {
+
+// A function local carried through the communication block between the main
+// path and an outlined region.
+struct CommSlot {
+  Index local;
+  Type type;
+  uint32_t offset;
+  // Written by the main path before the offload, read by the outlined region.
+  bool isInput = false;
+  // Written by the outlined region on exit, read back by the main path.
+  bool isOutput = false;
+  // Holds the function's return value after an early return from the region,
+  // local is unused.
+  bool isResult = false;
+};
+
+enum class CommDirection { Inputs, Outputs };
+
+// Memory layout of the communication block of one outlined region.
+//
+// Slots are sorted by descending size, which for wasm value types is also
+// their natural alignment, so they are packed without any padding and every
+// access can use its natural alignment.
+struct CommBlockLayout {
+  std::vector<CommSlot> slots;
+  uint32_t size = 0;
+  uint32_t align = 1;
+
+  // Throws std::runtime_error if any of the locals or the function result has
+  // a type that can't be stored in linear memory. A result slot is only added
+  // if hasResult, when the region returns a value from the function.
+  static CommBlockLayout pack(Function* func,
+                              const std::vector<Index>& inputs,
+                              const std::vector<Index>& outputs,
+                              bool hasResult);
+
+  const CommSlot* getResultSlot() const;
+
+  // Stores the selected slots from locals (at index slot.local + localShift)
+  // into the block pointed to by local ptrLocal.
+  Expression* makeSerialize(Builder& builder,
+                            CommDirection direction,
+                            Index ptrLocal,
+                            Type ptrType,
+                            Index localShift = 0) const;
+
+  // Loads the selected slots from the block pointed to by local ptrLocal into
+  // locals (at index slot.local + localShift).
+  Expression* makeDeserialize(Builder& builder,
+                              CommDirection direction,
+                              Index ptrLocal,
+                              Type ptrType,
+                              Index localShift = 0) const;
+
+  // Stores value into the result slot of the block pointed to by ptrLocal.
+  Expression* makeResultStore(Builder& builder,
+                              Index ptrLocal,
+                              Type ptrType,
+                              Expression* value) const;
+
+  // Loads the result slot of the block pointed to by ptrLocal.
+  Expression* makeResultLoad(Builder& builder,
+                             Index ptrLocal,
+                             Type ptrType) const;
+};
+
+} // namespace wasm
+
+#endif
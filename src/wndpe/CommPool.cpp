@@ -0,0 +1,173 @@
+#include "wndpe/CommPool.h"
+
+#include <stdexcept>
+#include <string_view>
+
+#include <fmt/core.h>
+
+#include "wndpe/Intrinsics.h"
+
+namespace wasm {
+
+namespace {
+
+// Smallest class, large enough to hold the free list link of a 64-bit
+// pointer and every value type at its natural alignment.
+constexpr std::uint64_t MinClassBytes = 16;
+// Larger comm blocks are rare and big enough that the runtime's allocator
+// isn't the bottleneck.
+constexpr int NumClasses = 9;
+
+// Prefix of the names of every global and function of the pool.
+constexpr std::string_view PoolPrefix = "__wndpe_pool_";
+
+std::uint64_t getClassBytes(int sizeClass) {
+  return MinClassBytes << sizeClass;
+}
+
+Name getHeadName(int sizeClass) {
+  return fmt::format("__wndpe_pool_{}", getClassBytes(sizeClass));
+}
+
+Name getAllocName(int sizeClass) {
+  return fmt::format("__wndpe_pool_alloc_{}", getClassBytes(sizeClass));
+}
+
+Name getFreeName(int sizeClass) {
+  return fmt::format("__wndpe_pool_free_{}", getClassBytes(sizeClass));
+}
+
+// (func $__wndpe_pool_alloc_N (result ptr)
+//   (if (result ptr) (global.get $__wndpe_pool_N)
+//     (block
+//       (local.set $block (global.get $__wndpe_pool_N))
+//       (global.set $__wndpe_pool_N (ptr.load (local.get $block)))
+//       (local.get $block))
+//     (call $__wndpe_outline_alloc (N))))
+std::unique_ptr<Function>
+makePoolAlloc(Builder& builder, Type ptrType, int sizeClass) {
+  Name head = getHeadName(sizeClass);
+  constexpr Index blockLocal = 0;
+  Expression* pop = builder.makeBlock(
+    {builder.makeLocalSet(blockLocal, builder.makeGlobalGet(head, ptrType)),
+     builder.makeGlobalSet(
+       head,
+       builder.makeLoad(ptrType.getByteSize(),
+                        false,
+                        0,
+                        ptrType.getByteSize(),
+                        builder.makeLocalGet(blockLocal, ptrType),
+                        ptrType)),
+     builder.makeLocalGet(blockLocal, ptrType)});
+  Expression* fresh = builder.makeCall(
+    IntrinsicOutlineAlloc,
+    {builder.makeConst(
+      Literal::makeFromInt64(getClassBytes(sizeClass), ptrType))},
+    ptrType);
+  std::vector<NameType> vars;
+  vars.emplace_back("block", ptrType);
+  return builder.makeFunction(
+    getAllocName(sizeClass),
+    {},
+    Signature(Type::none, ptrType),
+    std::move(vars),
+    builder.makeIf(builder.makeGlobalGet(head, ptrType), pop, fresh));
+}
+
+// (func $__wndpe_pool_free_N (param $block ptr)
+//   (ptr.store (local.get $block) (global.get $__wndpe_pool_N))
+//   (global.set $__wndpe_pool_N (local.get $block)))
+std::unique_ptr<Function>
+makePoolFree(Builder& builder, Type ptrType, int sizeClass) {
+  Name head = getHeadName(sizeClass);
+  constexpr Index blockLocal = 0;
+  std::vector<NameType> params;
+  params.emplace_back("block", ptrType);
+  return builder.makeFunction(
+    getFreeName(sizeClass),
+    std::move(params),
+    Signature(ptrType, Type::none),
+    {},
+    builder.makeSequence(
+      builder.makeStore(ptrType.getByteSize(),
+                        0,
+                        ptrType.getByteSize(),
+                        builder.makeLocalGet(blockLocal, ptrType),
+                        builder.makeGlobalGet(head, ptrType),
+                        ptrType),
+      builder.makeGlobalSet(head, builder.makeLocalGet(blockLocal, ptrType))));
+}
+
+} // namespace
+
+int getCommPoolClass(std::uint64_t size) {
+  for (int sizeClass = 0; sizeClass < NumClasses; sizeClass++) {
+    if (size <= getClassBytes(sizeClass)) {
+      return sizeClass;
+    }
+  }
+  return -1;
+}
+
+Expression* makeCommBlockAlloc(Builder& builder,
+                               Type ptrType,
+                               std::uint64_t size,
+                               CommPoolClasses& classes) {
+  int sizeClass = getCommPoolClass(size);
+  if (sizeClass < 0) {
+    return builder.makeCall(
+      IntrinsicOutlineAlloc,
+      {builder.makeConst(Literal::makeFromInt64(size, ptrType))},
+      ptrType);
+  }
+  classes |= CommPoolClasses(1) << sizeClass;
+  return builder.makeCall(getAllocName(sizeClass), {}, ptrType);
+}
+
+Expression* makeCommBlockFree(Builder& builder,
+                              Expression* ptr,
+                              std::uint64_t size,
+                              CommPoolClasses& classes) {
+  int sizeClass = getCommPoolClass(size);
+  if (sizeClass < 0) {
+    return builder.makeCall(IntrinsicOutlineFree, {ptr}, Type::none);
+  }
+  classes |= CommPoolClasses(1) << sizeClass;
+  return builder.makeCall(getFreeName(sizeClass), {ptr}, Type::none);
+}
+
+void checkCommPoolNames(const Module& wasm) {
+  auto check = [](Name name) {
+    if (std::string_view(name.c_str()).starts_with(PoolPrefix)) {
+      throw std::runtime_error(
+        fmt::format("Module already defines {}, which clashes with the comm "
+                    "block pool",
+                    name.c_str()));
+    }
+  };
+  for (auto& global : wasm.globals) {
+    check(global->name);
+  }
+  for (auto& func : wasm.functions) {
+    check(func->name);
+  }
+}
+
+void addCommPool(Module& wasm, CommPoolClasses classes) {
+  Builder builder(wasm);
+  Type ptrType = getPointerType(wasm);
+  for (int sizeClass = 0; sizeClass < NumClasses; sizeClass++) {
+    if (!(classes & (CommPoolClasses(1) << sizeClass))) {
+      continue;
+    }
+    wasm.addGlobal(
+      builder.makeGlobal(getHeadName(sizeClass),
+                         ptrType,
+                         builder.makeConst(Literal::makeFromInt64(0, ptrType)),
+                         Builder::Mutable));
+    wasm.addFunction(makePoolAlloc(builder, ptrType, sizeClass));
+    wasm.addFunction(makePoolFree(builder, ptrType, sizeClass));
+  }
+}
+
+} // namespace wasm
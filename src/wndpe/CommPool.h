@@ -0,0 +1,55 @@
+#ifndef WNDPE_COMMPOOL_H_INCLUDED
+#define WNDPE_COMMPOOL_H_INCLUDED 1
+
+#include <cstdint>
+
+#include <wasm-builder.h>
+#include <wasm.h>
+
+namespace wasm {
+
+// A pool of comm blocks kept inside the outlined module, so an offload in a
+// hot loop doesn't go through the runtime's allocator every time.
+//
+// Comm block sizes are known when the call sites are generated, so each
+// site allocates from a fixed power-of-two size class. Every class is a
+// free list whose head lives in a mutable global; blocks are taken from the
+// runtime's alloc intrinsic when the list is empty and never given back.
+// The heads are neither exported nor shared, so they are private to each
+// instance, and so to each thread of a threaded module, and the lists need
+// no atomics: an alloc and its free always run in the same function
+// activation. Exporting a head or making it shared would break that.
+//
+// Blocks cached by a thread that exits are never handed back to the
+// runtime, they are leaked for the lifetime of the shared memory.
+
+// Bit set of the size classes used by a module, bit k for class k.
+using CommPoolClasses = std::uint32_t;
+
+// Size class serving blocks of size bytes, or -1 if they are too large for
+// the pool and come from the alloc intrinsic directly.
+int getCommPoolClass(std::uint64_t size);
+
+// Allocates or releases a block of size bytes, from the pool if size fits a
+// class, which is then added to classes.
+Expression* makeCommBlockAlloc(Builder& builder,
+                               Type ptrType,
+                               std::uint64_t size,
+                               CommPoolClasses& classes);
+Expression* makeCommBlockFree(Builder& builder,
+                              Expression* ptr,
+                              std::uint64_t size,
+                              CommPoolClasses& classes);
+
+// Throws std::runtime_error if the module already has a global or function
+// named like the pool's, which can't be told apart from a user's.
+void checkCommPoolNames(const Module& wasm);
+
+// Adds the globals and functions of the given classes, which must not exist
+// yet (see checkCommPoolNames). The alloc and free intrinsics must be
+// imported.
+void addCommPool(Module& wasm, CommPoolClasses classes);
+
+} // namespace wasm
+
+#endif
@@ -0,0 +1,580 @@
+#include "wndpe/Footprint.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <unordered_map>
+
+#include <ir/find_all.h>
+#include <wasm-traversal.h>
+
+#include <fmt/format.h>
+
+#include "wndpe/Instrumentation.h"
+
+namespace wasm {
+
+using wndpe::AddressTerm;
+using wndpe::MemoryAccess;
+
+namespace {
+
+// How many assignments deep a local is substituted by its value.
+constexpr int MaxSubstitutionDepth = 4;
+
+// constant + sum(coef * local). Arithmetic wraps in wasm but not here, which
+// only matters for addresses that wrap around, i.e. never in practice.
+struct LinearForm {
+  int64_t constant = 0;
+  std::map<Index, int64_t> coefs;
+  bool known = true;
+
+  void add(const LinearForm& other, int64_t scale) {
+    known = known && other.known;
+    constant += scale * other.constant;
+    for (auto [local, coef] : other.coefs) {
+      coefs[local] += scale * coef;
+    }
+  }
+
+  void multiply(int64_t factor) {
+    constant *= factor;
+    for (auto& [local, coef] : coefs) {
+      coef *= factor;
+    }
+  }
+
+  bool isConstant() const { return known && coefs.empty(); }
+};
+
+LinearForm toLinear(Expression* curr) {
+  LinearForm form;
+  if (auto* c = curr->dynCast<Const>(); c && c->type.isInteger()) {
+    form.constant = c->value.getInteger();
+    return form;
+  } else if (auto* get = curr->dynCast<LocalGet>()) {
+    form.coefs[get->index] = 1;
+    return form;
+  } else if (auto* set = curr->dynCast<LocalSet>(); set && set->isTee()) {
+    return toLinear(set->value);
+  } else if (auto* unary = curr->dynCast<Unary>()) {
+    if (unary->op == ExtendUInt32 || unary->op == ExtendSInt32 ||
+        unary->op == WrapInt64) {
+      return toLinear(unary->value);
+    }
+  } else if (auto* binary = curr->dynCast<Binary>()) {
+    LinearForm left = toLinear(binary->left);
+    LinearForm right = toLinear(binary->right);
+    switch (binary->op) {
+      case AddInt32:
+      case AddInt64:
+        left.add(right, 1);
+        return left;
+      case SubInt32:
+      case SubInt64:
+        left.add(right, -1);
+        return left;
+      case MulInt32:
+      case MulInt64:
+        if (right.isConstant()) {
+          left.multiply(right.constant);
+          return left;
+        } else if (left.isConstant()) {
+          right.multiply(left.constant);
+          return right;
+        }
+        break;
+      case ShlInt32:
+      case ShlInt64:
+        if (right.isConstant() && right.constant >= 0 && right.constant < 63) {
+          left.multiply(int64_t(1) << right.constant);
+          return left;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  form.known = false;
+  return form;
+}
+
+// What the value of a local is inside the region.
+struct LocalValue {
+  enum class Kind { Invariant, Induction, Derived, Unknown };
+
+  Kind kind = Kind::Invariant;
+  // Induction: step per update and the constant it is initialized with, if
+  // the region initializes it.
+  int64_t step = 0;
+  bool hasInitial = false;
+  int64_t initial = 0;
+  // Derived: the value of the only assignment, which runs before every read.
+  LinearForm value;
+};
+
+class FootprintBuilder {
+public:
+  FootprintBuilder(const std::vector<Expression*>& code,
+                   const CommBlockLayout& layout) {
+    for (const CommSlot& slot : layout.slots) {
+      if (slot.isInput && !slot.isResult) {
+        inputSlots[slot.local] = slot.offset;
+      }
+    }
+    std::unordered_map<Index, std::vector<LocalSet*>> sets;
+    for (Expression* curr : code) {
+      for (LocalSet* set : FindAll<LocalSet>(curr).list) {
+        sets[set->index].push_back(set);
+      }
+      for (LocalGet* get : FindAll<LocalGet>(curr).list) {
+        numReads[get->index]++;
+      }
+      for (Block* block : FindAll<Block>(curr).list) {
+        noteReadsAfter(block->list);
+      }
+    }
+    noteReadsAfter(code);
+    for (auto& [local, localSets] : sets) {
+      values[local] = classify(local, localSets);
+    }
+  }
+
+  // Fills in offset and terms (or sets unknown) of access for the address
+  // ptr + memargOffset.
+  void resolveAddress(MemoryAccess& access,
+                      Expression* ptr,
+                      uint64_t memargOffset) {
+    access.offset = int64_t(memargOffset);
+    if (!resolve(toLinear(ptr),
+                 1,
+                 MaxSubstitutionDepth,
+                 access.offset,
+                 access.terms)) {
+      access.offset = int64_t(memargOffset);
+      access.terms.clear();
+      access.unknown = true;
+    }
+    normalize(access.terms);
+  }
+
+  void resolveLength(MemoryAccess& access, Expression* size) {
+    int64_t bytes = 0;
+    if (!resolve(toLinear(size),
+                 1,
+                 MaxSubstitutionDepth,
+                 bytes,
+                 access.lengthTerms)) {
+      access.lengthTerms.clear();
+      access.unknown = true;
+      return;
+    }
+    access.bytes = bytes;
+    normalize(access.lengthTerms);
+  }
+
+private:
+  // Records, for every local.set that is a statement of its own in list, how
+  // many reads of its local the statements after it contain.
+  template<typename List> void noteReadsAfter(const List& list) {
+    std::unordered_map<Index, Index> laterReads;
+    for (Index i = list.size(); i-- > 0;) {
+      if (auto* set = list[i]->template dynCast<LocalSet>()) {
+        readsAfter[set] = laterReads[set->index];
+      }
+      for (LocalGet* get : FindAll<LocalGet>(list[i]).list) {
+        laterReads[get->index]++;
+      }
+    }
+  }
+
+  // Whether set runs before every read of its local in the region: all of
+  // them have to follow it in the statements of the same block, which
+  // structured control flow can't enter past the set.
+  bool dominatesReads(LocalSet* set) const {
+    auto after = readsAfter.find(set);
+    if (after == readsAfter.end()) {
+      return false;
+    }
+    auto reads = numReads.find(set->index);
+    return reads == numReads.end() || reads->second == after->second;
+  }
+
+  // A value assigned where it might not reach every read is unknown, reads
+  // could still see the incoming value or one from an earlier iteration.
+  LocalValue classify(Index local, const std::vector<LocalSet*>& localSets) {
+    LocalValue result;
+    if (localSets.size() == 1 && dominatesReads(localSets[0])) {
+      LinearForm value = toLinear(localSets[0]->value);
+      if (value.known && !value.coefs.count(local)) {
+        result.kind = LocalValue::Kind::Derived;
+        result.value = std::move(value);
+        return result;
+      }
+    }
+    bool hasStep = false;
+    for (LocalSet* set : localSets) {
+      LinearForm value = toLinear(set->value);
+      if (value.isConstant() && !result.hasInitial && dominatesReads(set)) {
+        result.hasInitial = true;
+        result.initial = value.constant;
+        continue;
+      }
+      bool isIncrement = value.known && value.coefs.size() == 1 &&
+                         value.coefs.count(local) && value.coefs[local] == 1;
+      if (!isIncrement || (hasStep && value.constant != result.step)) {
+        result.kind = LocalValue::Kind::Unknown;
+        return result;
+      }
+      hasStep = true;
+      result.step = value.constant;
+    }
+    result.kind = LocalValue::Kind::Induction;
+    return result;
+  }
+
+  bool resolve(const LinearForm& form,
+               int64_t scale,
+               int depth,
+               int64_t& offset,
+               std::vector<AddressTerm>& terms) {
+    if (!form.known) {
+      return false;
+    }
+    offset += scale * form.constant;
+    for (auto [local, coef] : form.coefs) {
+      if (coef == 0) {
+        continue;
+      }
+      LocalValue value;
+      if (auto found = values.find(local); found != values.end()) {
+        value = found->second;
+      }
+      auto slot = inputSlots.find(local);
+      AddressTerm term;
+      term.scale = scale * coef;
+      switch (value.kind) {
+        case LocalValue::Kind::Invariant:
+          if (slot == inputSlots.end()) {
+            return false;
+          }
+          term.slotOffset = slot->second;
+          break;
+        case LocalValue::Kind::Induction:
+          term.step = value.step;
+          if (value.hasInitial) {
+            term.initial = value.initial;
+          } else if (slot != inputSlots.end()) {
+            term.slotOffset = slot->second;
+          } else {
+            return false;
+          }
+          break;
+        case LocalValue::Kind::Derived:
+          if (depth == 0 ||
+              !resolve(value.value, scale * coef, depth - 1, offset, terms)) {
+            return false;
+          }
+          continue;
+        case LocalValue::Kind::Unknown:
+          return false;
+      }
+      terms.push_back(term);
+    }
+    return true;
+  }
+
+  // Merges terms of the same value and drops the ones that cancel out.
+  static void normalize(std::vector<AddressTerm>& terms) {
+    std::vector<AddressTerm> merged;
+    for (const AddressTerm& term : terms) {
+      auto same = std::find_if(
+        merged.begin(), merged.end(), [&](const AddressTerm& other) {
+          return other.slotOffset == term.slotOffset &&
+                 other.initial == term.initial && other.step == term.step;
+        });
+      if (same != merged.end()) {
+        same->scale += term.scale;
+      } else {
+        merged.push_back(term);
+      }
+    }
+    std::erase_if(merged,
+                  [](const AddressTerm& term) { return term.scale == 0; });
+    terms = std::move(merged);
+  }
+
+  std::unordered_map<Index, uint32_t> inputSlots;
+  std::unordered_map<Index, LocalValue> values;
+  // Reads of each local in the region.
+  std::unordered_map<Index, Index> numReads;
+  // Statement local.sets, see noteReadsAfter.
+  std::unordered_map<LocalSet*, Index> readsAfter;
+};
+
+struct AccessCollector : public PostWalker<AccessCollector> {
+  FootprintBuilder& builder;
+  wndpe::RegionFootprint& footprint;
+
+  AccessCollector(FootprintBuilder& builder,
+                  wndpe::RegionFootprint& footprint)
+    : builder(builder), footprint(footprint) {}
+
+  void add(MemoryAccess access) {
+    auto isInduction = [](const AddressTerm& term) { return term.step != 0; };
+    footprint.complete =
+      footprint.complete && !access.unknown &&
+      std::none_of(access.terms.begin(), access.terms.end(), isInduction) &&
+      std::none_of(
+        access.lengthTerms.begin(), access.lengthTerms.end(), isInduction);
+    auto& accesses = footprint.accesses;
+    if (std::find(accesses.begin(), accesses.end(), access) ==
+        accesses.end()) {
+      accesses.push_back(std::move(access));
+    }
+  }
+
+  void addFixed(MemoryAccess::Kind kind,
+                Expression* ptr,
+                uint64_t offset,
+                uint32_t bytes) {
+    MemoryAccess access;
+    access.kind = kind;
+    access.bytes = bytes;
+    builder.resolveAddress(access, ptr, offset);
+    add(std::move(access));
+  }
+
+  void addBulk(MemoryAccess::Kind kind, Expression* ptr, Expression* size) {
+    MemoryAccess access;
+    access.kind = kind;
+    builder.resolveAddress(access, ptr, 0);
+    builder.resolveLength(access, size);
+    add(std::move(access));
+  }
+
+  void visitLoad(Load* curr) {
+    addFixed(MemoryAccess::Kind::Load, curr->ptr, curr->offset, curr->bytes);
+  }
+  void visitStore(Store* curr) {
+    addFixed(MemoryAccess::Kind::Store, curr->ptr, curr->offset, curr->bytes);
+  }
+  // Read-modify-write operations need the page shipped both ways, which is
+  // what a store implies.
+  void visitAtomicRMW(AtomicRMW* curr) {
+    addFixed(MemoryAccess::Kind::Store, curr->ptr, curr->offset, curr->bytes);
+  }
+  void visitAtomicCmpxchg(AtomicCmpxchg* curr) {
+    addFixed(MemoryAccess::Kind::Store, curr->ptr, curr->offset, curr->bytes);
+  }
+  void visitAtomicWait(AtomicWait* curr) {
+    addFixed(MemoryAccess::Kind::Load,
+             curr->ptr,
+             curr->offset,
+             curr->expectedType.getByteSize());
+  }
+  void visitSIMDLoad(SIMDLoad* curr) {
+    addFixed(MemoryAccess::Kind::Load,
+             curr->ptr,
+             curr->offset,
+             curr->getMemBytes());
+  }
+  void visitSIMDLoadStoreLane(SIMDLoadStoreLane* curr) {
+    addFixed(curr->isStore() ? MemoryAccess::Kind::Store
+                             : MemoryAccess::Kind::Load,
+             curr->ptr,
+             curr->offset,
+             curr->getMemBytes());
+  }
+  void visitMemoryCopy(MemoryCopy* curr) {
+    addBulk(MemoryAccess::Kind::CopySource, curr->source, curr->size);
+    addBulk(MemoryAccess::Kind::CopyDest, curr->dest, curr->size);
+  }
+  void visitMemoryFill(MemoryFill* curr) {
+    addBulk(MemoryAccess::Kind::Fill, curr->dest, curr->size);
+  }
+  // The data segment isn't in linear memory, only the destination is.
+  void visitMemoryInit(MemoryInit* curr) {
+    addBulk(MemoryAccess::Kind::CopyDest, curr->dest, curr->size);
+  }
+  // Callees aren't analysed, and a grow makes every later access relative
+  // to a memory the runtime hasn't seen.
+  void addOpaque() {
+    MemoryAccess access;
+    access.kind = MemoryAccess::Kind::Opaque;
+    access.unknown = true;
+    add(std::move(access));
+  }
+  void visitCall(Call* curr) { addOpaque(); }
+  void visitCallIndirect(CallIndirect* curr) { addOpaque(); }
+  void visitCallRef(CallRef* curr) { addOpaque(); }
+  void visitMemoryGrow(MemoryGrow* curr) { addOpaque(); }
+};
+
+const char* getKindName(MemoryAccess::Kind kind) {
+  switch (kind) {
+    case MemoryAccess::Kind::Load:
+      return "load";
+    case MemoryAccess::Kind::Store:
+      return "store";
+    case MemoryAccess::Kind::CopySource:
+      return "copy-source";
+    case MemoryAccess::Kind::CopyDest:
+      return "copy-dest";
+    case MemoryAccess::Kind::Fill:
+      return "fill";
+    case MemoryAccess::Kind::Opaque:
+      return "opaque";
+  }
+  return "unknown";
+}
+
+void appendTerms(fmt::memory_buffer& out,
+                 const std::vector<AddressTerm>& terms) {
+  auto it = std::back_inserter(out);
+  fmt::format_to(it, "[");
+  for (size_t i = 0; i < terms.size(); i++) {
+    const AddressTerm& term = terms[i];
+    fmt::format_to(it, "{}{{\"scale\":{}", i == 0 ? "" : ",", term.scale);
+    if (term.slotOffset >= 0) {
+      fmt::format_to(it, ",\"slot\":{}", term.slotOffset);
+    } else {
+      fmt::format_to(it, ",\"initial\":{}", term.initial);
+    }
+    fmt::format_to(it, ",\"step\":{}}}", term.step);
+  }
+  fmt::format_to(it, "]");
+}
+
+void writeTerms(std::ostream& out, const std::vector<AddressTerm>& terms) {
+  out << ' ' << terms.size();
+  for (const AddressTerm& term : terms) {
+    out << ' ' << term.slotOffset << ' ' << term.initial << ' ' << term.step
+        << ' ' << term.scale;
+  }
+}
+
+bool readTerms(std::istream& in, std::vector<AddressTerm>& terms) {
+  size_t numTerms;
+  if (!(in >> numTerms)) {
+    return false;
+  }
+  terms.resize(numTerms);
+  for (AddressTerm& term : terms) {
+    if (!(in >> term.slotOffset >> term.initial >> term.step >> term.scale)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+wndpe::RegionFootprint
+computeRegionFootprint(const std::vector<Expression*>& code,
+                       const CommBlockLayout& layout) {
+  wndpe::RegionFootprint footprint;
+  footprint.commBlockSize = layout.size;
+  FootprintBuilder builder(code, layout);
+  AccessCollector collector(builder, footprint);
+  for (Expression* curr : code) {
+    collector.walk(curr);
+  }
+  return footprint;
+}
+
+// footprints <count>, then for each footprint
+//   footprint <function> <comm block size> <complete> <accesses>
+// followed by one line per access:
+//   <kind> <offset> <bytes> <unknown> <terms> <length terms>
+// where each list of terms is its size followed by the fields of each term.
+void writeFootprints(std::ostream& out,
+                     const std::vector<wndpe::RegionFootprint>& footprints) {
+  out << "footprints " << footprints.size() << '\n';
+  for (const wndpe::RegionFootprint& footprint : footprints) {
+    out << "footprint " << std::quoted(footprint.function) << ' '
+        << footprint.commBlockSize << ' ' << footprint.complete << ' '
+        << footprint.accesses.size() << '\n';
+    for (const MemoryAccess& access : footprint.accesses) {
+      out << int(access.kind) << ' ' << access.offset << ' ' << access.bytes
+          << ' ' << access.unknown;
+      writeTerms(out, access.terms);
+      writeTerms(out, access.lengthTerms);
+      out << '\n';
+    }
+  }
+}
+
+bool readFootprints(std::istream& in,
+                    std::vector<wndpe::RegionFootprint>& footprints) {
+  std::string word;
+  size_t numFootprints;
+  if (!(in >> word >> numFootprints) || word != "footprints") {
+    return false;
+  }
+  footprints.resize(numFootprints);
+  for (wndpe::RegionFootprint& footprint : footprints) {
+    size_t numAccesses;
+    if (!(in >> word) || word != "footprint" ||
+        !(in >> std::quoted(footprint.function) >> footprint.commBlockSize >>
+          footprint.complete >> numAccesses)) {
+      return false;
+    }
+    footprint.accesses.resize(numAccesses);
+    for (MemoryAccess& access : footprint.accesses) {
+      int kind;
+      if (!(in >> kind >> access.offset >> access.bytes >> access.unknown) ||
+          kind < int(MemoryAccess::Kind::Load) ||
+          kind > int(MemoryAccess::Kind::Opaque) ||
+          !readTerms(in, access.terms) || !readTerms(in, access.lengthTerms)) {
+        return false;
+      }
+      access.kind = MemoryAccess::Kind(kind);
+    }
+  }
+  return true;
+}
+
+} // namespace wasm
+
+namespace wndpe {
+
+std::string OutliningReport::toJson() const {
+  fmt::memory_buffer out;
+  auto it = std::back_inserter(out);
+  fmt::format_to(it, "{{\"regions\":[");
+  for (size_t r = 0; r < regions.size(); r++) {
+    const RegionFootprint& region = regions[r];
+    fmt::format_to(it,
+                   "{}\n  {{\"function\":{},\"commBlockSize\":{},"
+                   "\"complete\":{},\"accesses\":[",
+                   r == 0 ? "" : ",",
+                   toJsonString(region.function),
+                   region.commBlockSize,
+                   region.complete);
+    for (size_t a = 0; a < region.accesses.size(); a++) {
+      const MemoryAccess& access = region.accesses[a];
+      fmt::format_to(it,
+                     "{}\n    {{\"kind\":\"{}\"",
+                     a == 0 ? "" : ",",
+                     wasm::getKindName(access.kind));
+      if (access.unknown) {
+        fmt::format_to(it, ",\"unknown\":true}}");
+        continue;
+      }
+      fmt::format_to(it, ",\"offset\":{},\"terms\":", access.offset);
+      wasm::appendTerms(out, access.terms);
+      fmt::format_to(it, ",\"bytes\":{}", access.bytes);
+      if (!access.lengthTerms.empty()) {
+        fmt::format_to(it, ",\"lengthTerms\":");
+        wasm::appendTerms(out, access.lengthTerms);
+      }
+      fmt::format_to(it, "}}");
+    }
+    fmt::format_to(it, "]}}");
+  }
+  fmt::format_to(it, "\n]}}\n");
+  return fmt::to_string(out);
+}
+
+} // namespace wndpe
@@ -0,0 +1,35 @@
+#ifndef WNDPE_FOOTPRINT_H_INCLUDED
+#define WNDPE_FOOTPRINT_H_INCLUDED 1
+
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include <wasm.h>
+
+#include "wndpe/CommBlock.h"
+#include "wndpe/wndpe.h"
+
+namespace wasm {
+
+// Describes the addresses accessed by the code of a region (the expressions
+// between its markers) in terms of its comm block. Addresses are linear
+// combinations of locals; a local is resolved to the input slot it is
+// shipped in if the region never writes it, to an induction variable if the
+// region only ever adds a constant to it (after at most one constant
+// initialization), or to the linear value of its only assignment.
+wndpe::RegionFootprint
+computeRegionFootprint(const std::vector<Expression*>& code,
+                       const CommBlockLayout& layout);
+
+// Writes footprints as whitespace separated fields, for the output cache.
+void writeFootprints(std::ostream& out,
+                     const std::vector<wndpe::RegionFootprint>& footprints);
+
+// Reads what writeFootprints wrote. Returns false on malformed input.
+bool readFootprints(std::istream& in,
+                    std::vector<wndpe::RegionFootprint>& footprints);
+
+} // namespace wasm
+
+#endif
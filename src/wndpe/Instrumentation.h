@@ -0,0 +1,62 @@
+#ifndef WNDPE_INSTRUMENTATION_H_INCLUDED
+#define WNDPE_INSTRUMENTATION_H_INCLUDED 1
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include <fmt/core.h>
+
+#include "wndpe/wndpe.h"
+
+#ifndef WNDPE_MAX_LOG_LEVEL
+#define WNDPE_MAX_LOG_LEVEL 3
+#endif
+
+namespace wndpe {
+
+extern std::atomic<int> currentLogLevel;
+
+inline bool isLogEnabled(LogLevel level) {
+  return static_cast<int>(level) <= WNDPE_MAX_LOG_LEVEL &&
+         static_cast<int>(level) <=
+           currentLogLevel.load(std::memory_order_relaxed);
+}
+
+// Quotes and escapes text as a JSON string.
+std::string toJsonString(std::string_view text);
+
+// Adds the seconds elapsed during its lifetime to target.
+class ScopedTimer {
+public:
+  explicit ScopedTimer(double* target)
+    : target(target), start(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    if (target) {
+      *target += std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+    }
+  }
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+  double* target;
+  std::chrono::steady_clock::time_point start;
+};
+
+} // namespace wndpe
+
+// Prints to stderr if the level is enabled. The arguments are not evaluated
+// otherwise, so they may be expensive to compute.
+#define WNDPE_LOG(level, ...)                                                  \
+  do {                                                                         \
+    if (::wndpe::isLogEnabled(::wndpe::LogLevel::level)) {                     \
+      fmt::print(stderr, __VA_ARGS__);                                         \
+    }                                                                          \
+  } while (0)
+
+#endif
@@ -0,0 +1,104 @@
+#include "wndpe/Intrinsics.h"
+
+#include <stdexcept>
+
+#include <wasm-builder.h>
+#include <wasm-traversal.h>
+
+#include <fmt/core.h>
+
+namespace wasm {
+
+Type getPointerType(const Module& wasm) {
+  return wasm.features.hasMemory64() ? Type::i64 : Type::i32;
+}
+
+Signature getIntrinsicSignature(const Module& wasm, Name name) {
+  Type ptrType = getPointerType(wasm);
+  if (name == IntrinsicOutlineBegin || name == IntrinsicOutlineEnd) {
+    return Signature(Type::none, Type::none);
+  } else if (name == IntrinsicOutlineCall) {
+    return Signature(Type{Type(HeapType::func, Nullable), ptrType, ptrType},
+                     Type::i32);
+  } else if (name == IntrinsicOutlineAlloc) {
+    return Signature(ptrType, ptrType);
+  } else if (name == IntrinsicOutlineFree) {
+    return Signature(ptrType, Type::none);
+  }
+  throw std::runtime_error(
+    fmt::format("{} is not an outlining intrinsic", name.c_str()));
+}
+
+void checkIntrinsicSignature(const Module& wasm, Name name) {
+  Signature sig = getIntrinsicSignature(wasm, name);
+  if (Function* existing = wasm.getFunctionOrNull(name)) {
+    if (existing->getSig() != sig) {
+      throw std::runtime_error(
+        fmt::format("{} has signature {}, expected {}",
+                    name.c_str(),
+                    existing->getSig().toString(),
+                    sig.toString()));
+    }
+  }
+}
+
+void ensureIntrinsicImport(Module& wasm, Name name) {
+  checkIntrinsicSignature(wasm, name);
+  if (wasm.getFunctionOrNull(name)) {
+    return;
+  }
+  auto import =
+    Builder::makeFunction(name, getIntrinsicSignature(wasm, name), {});
+  import->module = IntrinsicsModule;
+  import->base = name;
+  wasm.addFunction(std::move(import));
+}
+
+bool hasOutliningMarkers(Function* func) {
+  struct MarkerScanner : public PostWalker<MarkerScanner> {
+    bool found = false;
+    void visitCall(Call* curr) {
+      if (curr->target == IntrinsicOutlineBegin ||
+          curr->target == IntrinsicOutlineEnd) {
+        found = true;
+      }
+    }
+  } scanner;
+  if (func->imported()) {
+    return false;
+  }
+  scanner.walk(func->body);
+  return scanner.found;
+}
+
+bool hasTailCall(Expression* curr) {
+  struct TailCallFinder : public PostWalker<TailCallFinder> {
+    bool found = false;
+    void visitCall(Call* curr) { found = found || curr->isReturn; }
+    void visitCallIndirect(CallIndirect* curr) {
+      found = found || curr->isReturn;
+    }
+    void visitCallRef(CallRef* curr) { found = found || curr->isReturn; }
+  } finder;
+  finder.walk(curr);
+  return finder.found;
+}
+
+void checkOutliningIntrinsics(const Module& wasm) {
+  for (Name name : {IntrinsicOutlineBegin,
+                    IntrinsicOutlineEnd,
+                    IntrinsicOutlineCall,
+                    IntrinsicOutlineAlloc,
+                    IntrinsicOutlineFree}) {
+    checkIntrinsicSignature(wasm, name);
+  }
+}
+
+void addOutliningIntrinsics(Module& wasm) {
+  ensureIntrinsicImport(wasm, IntrinsicOutlineEnd);
+  ensureIntrinsicImport(wasm, IntrinsicOutlineCall);
+  ensureIntrinsicImport(wasm, IntrinsicOutlineAlloc);
+  ensureIntrinsicImport(wasm, IntrinsicOutlineFree);
+}
+
+} // namespace wasm
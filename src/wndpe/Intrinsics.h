@@ -0,0 +1,56 @@
+#ifndef WNDPE_INTRINSICS_H_INCLUDED
+#define WNDPE_INTRINSICS_H_INCLUDED 1
+
+#include <wasm.h>
+
+namespace wasm {
+
+// Import module of the functions provided by the offloading runtime.
+constexpr const char* IntrinsicsModule = "__builtins";
+
+// () -> (): marks the start of a region to offload.
+constexpr const char* IntrinsicOutlineBegin = "__wndpe_outline_begin";
+// () -> (): marks the end of a region to offload.
+constexpr const char* IntrinsicOutlineEnd = "__wndpe_outline_end";
+// (funcref fn, ptr comm_block, ptr size) -> i32: runs fn(comm_block, size)
+// on the storage node and returns its result, 1 if the region returned early.
+constexpr const char* IntrinsicOutlineCall = "__wndpe_outline_call";
+// (ptr size) -> ptr: allocates a comm block.
+constexpr const char* IntrinsicOutlineAlloc = "__wndpe_outline_alloc";
+// (ptr comm_block) -> (): releases a comm block.
+constexpr const char* IntrinsicOutlineFree = "__wndpe_outline_free";
+
+// Type of pointers into the module's linear memory.
+Type getPointerType(const Module& wasm);
+
+Signature getIntrinsicSignature(const Module& wasm, Name name);
+
+// Throws std::runtime_error if the module has a function of that name with
+// a different signature.
+void checkIntrinsicSignature(const Module& wasm, Name name);
+
+// Imports the intrinsic unless the module already has a function of that
+// name. Throws std::runtime_error if the existing function's signature
+// doesn't match.
+void ensureIntrinsicImport(Module& wasm, Name name);
+
+// Whether the function calls the begin or end marker directly.
+bool hasOutliningMarkers(Function* func);
+
+// Whether curr contains a return_call, return_call_indirect or
+// return_call_ref. Copied into an outlined function, a tail call would
+// return from it rather than from the caller, so regions can't have one.
+bool hasTailCall(Expression* curr);
+
+// Checks the signatures of the intrinsics the module already has, before
+// anything is rewritten to call them.
+void checkOutliningIntrinsics(const Module& wasm);
+
+// Imports the intrinsics used by the rewritten main path. Only runs once a
+// region has been outlined, after the function-parallel phase of the
+// outlining pass, which can't add to the module.
+void addOutliningIntrinsics(Module& wasm);
+
+} // namespace wasm
+
+#endif
@@ -1,27 +1,130 @@
 #include <cfg/cfg-traversal.h>
+#include <ir/abstract.h>
+#include <ir/find_all.h>
 #include <ir/iteration.h>
+#include <ir/module-utils.h>
 #include <ir/properties.h>
 #include <ir/type-updating.h>
+#include <ir/utils.h>
 #include <pass.h>
+#include <support/colors.h>
+#include <support/threads.h>
 #include <vector>
 #include <wasm-builder.h>
+#include <wasm-validator.h>
 #include <wasm.h>
 
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <set>
+#include <span>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <fmt/core.h>
 
+#include "wndpe/CommBlock.h"
+#include "wndpe/CommPool.h"
+#include "wndpe/Footprint.h"
+#include "wndpe/Instrumentation.h"
+#include "wndpe/Intrinsics.h"
+#include "wndpe/PlanCache.h"
+
 namespace wasm {
 
+struct LocalAction {
+  Index index;
+  bool isSet;
+};
+
+// Fixed-size bitset over the locals of one function.
+struct LocalBits {
+  std::vector<uint64_t> words;
+
+  LocalBits() = default;
+  explicit LocalBits(Index numLocals, bool filled = false)
+    : words((numLocals + 63) / 64, filled ? ~uint64_t(0) : 0) {}
+
+  bool get(Index i) const { return (words[i / 64] >> (i % 64)) & 1; }
+  void set(Index i) { words[i / 64] |= uint64_t(1) << (i % 64); }
+  void reset(Index i) { words[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+
+  void merge(const LocalBits& other) {
+    for (size_t i = 0; i < words.size(); i++) {
+      words[i] |= other.words[i];
+    }
+  }
+
+  void intersect(const LocalBits& other) {
+    for (size_t i = 0; i < words.size(); i++) {
+      words[i] &= other.words[i];
+    }
+  }
+
+  bool operator==(const LocalBits& other) const = default;
+};
+
 struct BlockInfo {
   Expression* node = nullptr;
+  Index id = 0;
   bool onMainPath = false;
   bool onOutlinedPath = false;
   bool hasBeginDirectly = false;
   bool hasEndDirectly = false;
+  // 1-based ordinal of the outlining region (in walk order) this block
+  // belongs to, 0 on the main path.
+  Index region = 0;
+  // Region closed by the end marker that precedes this block.
+  Index endsRegion = 0;
+  // local.get/local.set operations in execution order.
+  std::vector<LocalAction> actions;
 };
 
-static std::mutex OutliningModuleMutex;
+// Functions generated by the parallel phase, added to the module afterwards
+// in module order so the output doesn't depend on thread scheduling.
+struct OutliningStaging {
+  // Functions calling an outlining marker, mapped to their rank in module
+  // order. Everything else is skipped without building a CFG.
+  std::unordered_map<Function*, Index> functionIndices;
+  // Indexed by functionIndices, each slot is only ever written by the worker
+  // processing that function.
+  std::vector<std::vector<std::unique_ptr<Function>>> generated;
+  // Indexed like generated. A plan is either loaded from the cache before
+  // the parallel phase (cachedPlans is set) or filled by the analysis.
+  std::vector<OutliningPlan> plans;
+  std::vector<bool> cachedPlans;
+  // Content hashes, only computed when a cache is used.
+  std::vector<uint64_t> keys;
+  // Caches the whole result of each function (rewritten body, generated
+  // functions, pool classes and footprints), null if not: without a cache or
+  // when binaryen would print color codes into the entries.
+  const PlanCache* outputCache = nullptr;
+  // Indexed like generated, keys of the output cache.
+  std::vector<uint64_t> outputKeys;
+  // Indexed like generated, set by the worker that restored the function
+  // from the output cache (not a vector<bool>, workers write concurrently).
+  std::vector<uint8_t> cachedOutputs;
+  // Indexed like generated, only filled when stats are collected.
+  std::vector<wndpe::FunctionStats> functionStats;
+  // Indexed like generated, only filled when a report is requested.
+  std::vector<std::vector<wndpe::RegionFootprint>> footprints;
+  // Records per batch for regions in loops, below 2 to disable batching.
+  uint32_t batchRecords = 0;
+  // Whether comm blocks come from the in-module pool rather than straight
+  // from the alloc intrinsic.
+  bool commPool = false;
+  // Indexed like generated, the pool classes each function's rewrite uses.
+  std::vector<CommPoolClasses> poolClasses;
+  // Indexed like generated, why outlining the function failed.
+  std::vector<std::optional<std::string>> errors;
+};
 
 struct NdpOutliningPass
   : public WalkerPass<
@@ -30,13 +133,20 @@ struct NdpOutliningPass
   using Parent = WalkerPass<
     CFGWalker<NdpOutliningPass, Visitor<NdpOutliningPass>, BlockInfo>>;
 
+  OutliningStaging* staging;
   bool needsOutlining = false;
 
+  explicit NdpOutliningPass(OutliningStaging* staging) : staging(staging) {}
+
   bool isFunctionParallel() override { return true; }
 
-  Pass* create() override { return new NdpOutliningPass; }
+  Pass* create() override { return new NdpOutliningPass(staging); }
 
   BlockInfo nextInfo;
+  Index walkingRegion = 0;
+  Index numRegions = 0;
+  // Pool size classes used by the rewrite of the current function.
+  CommPoolClasses poolClasses = 0;
 
   BasicBlock* makeBasicBlock() {
     auto* bb = new BasicBlock();
@@ -44,6 +154,8 @@ struct NdpOutliningPass
     bb->contents = std::move(nextInfo);
     nextInfo = BlockInfo{};
     bb->contents.node = currp ? *currp : nullptr;
+    bb->contents.id = basicBlocks.size();
+    bb->contents.region = walkingRegion;
     return bb;
   }
 
@@ -69,50 +181,647 @@ struct NdpOutliningPass
   }
 
   void visitFunction(Function* func) {
-    fmt::print(stderr, "Visiting function {}\n", func->name.c_str());
+    WNDPE_LOG(Trace, "Visiting function {}\n", func->name.c_str());
   }
 
   void visitCall(Call* curr) {
-    fmt::print(stderr, "Visiting call to {}\n", curr->target.c_str());
-    bool putInOwnBlock = false;
+    WNDPE_LOG(Trace, "Visiting call to {}\n", curr->target.c_str());
+    bool endsBlock = false;
     if (curr->target == intrnOutlineBegin) {
+      if (walkingRegion != 0) {
+        throw std::runtime_error(
+          fmt::format("Nested outlining regions in {} are not supported",
+                      getFunction()->name.c_str()));
+      }
       nextInfo.hasBeginDirectly = true;
-      putInOwnBlock = true;
+      endsBlock = true;
       needsOutlining = true;
+      walkingRegion = ++numRegions;
     } else if (curr->target == intrnOutlineEnd) {
+      if (walkingRegion == 0) {
+        throw std::runtime_error(
+          fmt::format("Outlining end marker in {} has no matching begin marker",
+                      getFunction()->name.c_str()));
+      }
       nextInfo.hasEndDirectly = true;
-      putInOwnBlock = true;
+      nextInfo.endsRegion = walkingRegion;
+      endsBlock = true;
+      walkingRegion = 0;
     } else if (curr->target == intrnOutlineCall) {
       //
     }
-    if (putInOwnBlock) {
-      Builder builder(*getModule());
-      replaceCurrent(builder.makeBlock("outlining_block", curr));
-      doEndBlock(this, getCurrentPointer());
+    if (endsBlock) {
+      // The marker is the last instruction of its basic block, the code after
+      // it starts a new one carrying the marker flag.
+      auto* last = currBasicBlock;
+      startBasicBlock();
+      link(last, currBasicBlock);
+    }
+  }
+
+  void visitLocalGet(LocalGet* curr) {
+    if (currBasicBlock) {
+      currBasicBlock->contents.actions.push_back({curr->index, false});
+    }
+  }
+
+  void visitLocalSet(LocalSet* curr) {
+    if (currBasicBlock) {
+      currBasicBlock->contents.actions.push_back({curr->index, true});
+    }
+  }
+
+  // Backward may-liveness over the blocks accepted by inScope, successors
+  // outside of it are treated as having nothing live. Returns the live-in set
+  // of every block, indexed by BlockInfo::id.
+  template<typename InScope>
+  std::vector<LocalBits> computeLiveIn(Index numLocals, InScope inScope) {
+    std::vector<LocalBits> liveIn(basicBlocks.size(), LocalBits(numLocals));
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto it = basicBlocks.rbegin(); it != basicBlocks.rend(); ++it) {
+        BasicBlock* bb = it->get();
+        if (!bb || !inScope(bb)) {
+          continue;
+        }
+        LocalBits live(numLocals);
+        for (BasicBlock* succ : bb->out) {
+          if (inScope(succ)) {
+            live.merge(liveIn[succ->contents.id]);
+          }
+        }
+        const auto& actions = bb->contents.actions;
+        for (auto a = actions.rbegin(); a != actions.rend(); ++a) {
+          if (a->isSet) {
+            live.reset(a->index);
+          } else {
+            live.set(a->index);
+          }
+        }
+        if (!(live == liveIn[bb->contents.id])) {
+          liveIn[bb->contents.id] = std::move(live);
+          changed = true;
+        }
+      }
+    }
+    return liveIn;
+  }
+
+  // Forward must-definition over the blocks of one region, starting with
+  // nothing defined at regionEntry. Returns the set of locals written on every
+  // path from the entry to the end of each block, indexed by BlockInfo::id.
+  std::vector<LocalBits> computeMustDefOut(Index numLocals,
+                                           Index region,
+                                           BasicBlock* regionEntry) {
+    std::vector<LocalBits> defOut(basicBlocks.size(),
+                                  LocalBits(numLocals, true));
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto& bb : basicBlocks) {
+        if (!bb || bb->contents.region != region) {
+          continue;
+        }
+        LocalBits defs(numLocals, bb.get() != regionEntry);
+        if (bb.get() != regionEntry) {
+          for (BasicBlock* pred : bb->in) {
+            if (pred->contents.region == region) {
+              defs.intersect(defOut[pred->contents.id]);
+            }
+          }
+        }
+        for (const LocalAction& a : bb->contents.actions) {
+          if (a.isSet) {
+            defs.set(a.index);
+          }
+        }
+        if (!(defs == defOut[bb->contents.id])) {
+          defOut[bb->contents.id] = std::move(defs);
+          changed = true;
+        }
+      }
+    }
+    return defOut;
+  }
+
+  // Finds the locals that have to be shipped into and out of a region: inputs
+  // are read inside the region before being written, outputs are written
+  // inside the region and read after the end marker. liveIn is the liveness
+  // of the whole function.
+  void computeRegionLiveness(Function* func,
+                             Index region,
+                             BasicBlock* entryBlock,
+                             BasicBlock* exitBlock,
+                             const std::vector<LocalBits>& liveIn,
+                             std::vector<Index>& inputs,
+                             std::vector<Index>& outputs) {
+    Index numLocals = func->getNumLocals();
+    auto inRegion = [region](BasicBlock* bb) {
+      return bb->contents.region == region;
+    };
+    auto regionLiveIn = computeLiveIn(numLocals, inRegion);
+    auto mustDefOut = computeMustDefOut(numLocals, region, entryBlock);
+
+    LocalBits written(numLocals);
+    for (auto& bb : basicBlocks) {
+      if (bb && bb->contents.region == region) {
+        for (const LocalAction& a : bb->contents.actions) {
+          if (a.isSet) {
+            written.set(a.index);
+          }
+        }
+      }
+    }
+    LocalBits mustDefAtEnd(numLocals, true);
+    for (BasicBlock* pred : exitBlock->in) {
+      if (pred->contents.region == region) {
+        mustDefAtEnd.intersect(mustDefOut[pred->contents.id]);
+      }
+    }
+
+    const LocalBits& liveAtBegin = regionLiveIn[entryBlock->contents.id];
+    const LocalBits& liveAtEnd = liveIn[exitBlock->contents.id];
+    for (Index i = 0; i < numLocals; i++) {
+      bool isOutput = written.get(i) && liveAtEnd.get(i);
+      // An output that is not written on every path keeps its incoming value
+      // on the others, so that value has to be shipped in as well.
+      bool isInput =
+        liveAtBegin.get(i) || (isOutput && !mustDefAtEnd.get(i));
+      if (isInput) {
+        inputs.push_back(i);
+      }
+      if (isOutput) {
+        outputs.push_back(i);
+      }
+    }
+  }
+
+  // Position of an outlining region in the structured IR: both markers have
+  // to be direct children of the same block.
+  struct RegionBounds {
+    Block* parent = nullptr;
+    // Indices of the begin and end marker calls in parent->list.
+    Index begin = 0;
+    Index end = 0;
+  };
+
+  // Returns in the code between the markers, which leave the function
+  // through the early return flag of the outlined function.
+  struct RegionReturns {
+    bool any = false;
+    // Whether one returns a value, which needs a result slot.
+    bool withValue = false;
+  };
+
+  static RegionReturns findReturns(const RegionBounds& bounds) {
+    RegionReturns returns;
+    for (Index i = bounds.begin + 1; i < bounds.end; i++) {
+      for (Return* ret : FindAll<Return>(bounds.parent->list[i]).list) {
+        returns.any = true;
+        returns.withValue = returns.withValue || ret->value != nullptr;
+      }
     }
+    return returns;
   }
 
+  // Runs on binaryen's pool threads, which don't catch exceptions: errors
+  // are left in the staging slot for the driver pass to report.
   void doWalkFunction(Function* oldFunction) {
-    // Build the CFG.
+    auto stagingSlot = staging->functionIndices.find(oldFunction);
+    if (stagingSlot == staging->functionIndices.end()) {
+      return;
+    }
+    Index slot = stagingSlot->second;
+    try {
+      outlineFunction(oldFunction, slot);
+    } catch (const std::exception& e) {
+      staging->errors[slot] = e.what();
+    }
+  }
+
+  void outlineFunction(Function* oldFunction, Index slot) {
+    wndpe::FunctionStats* stats = nullptr;
+    if (!staging->functionStats.empty()) {
+      stats = &staging->functionStats[slot];
+      stats->name = oldFunction->name.c_str();
+    }
+    if (staging->outputCache) {
+      wndpe::ScopedTimer timer(stats ? &stats->copySeconds : nullptr);
+      if (restoreOutput(oldFunction, slot, stats)) {
+        staging->cachedOutputs[slot] = true;
+        return;
+      }
+    }
+    // The counters are stored with the output.
+    wndpe::FunctionStats outputStats;
+    if (!stats && staging->outputCache) {
+      stats = &outputStats;
+    }
+    OutliningPlan& plan = staging->plans[slot];
+    if (staging->cachedPlans[slot]) {
+      numRegions = plan.regions.size();
+    } else {
+      wndpe::ScopedTimer timer(stats ? &stats->cfgSeconds : nullptr);
+      if (!analyzeFunction(oldFunction, plan)) {
+        return;
+      }
+    }
+    WNDPE_LOG(Info,
+              "Will outline {} regions of {}\n",
+              numRegions,
+              oldFunction->name.c_str());
+    std::vector<RegionBounds> bounds = findRegions(oldFunction);
+    for (Index region = 1; region <= numRegions; region++) {
+      checkNoTailCalls(oldFunction, bounds[region - 1], region);
+    }
+    Index numLocals = plan.numLocals;
+    std::vector<RegionReturns> returns(numRegions + 1);
+    std::vector<CommBlockLayout> layouts(numRegions + 1);
+    for (Index region = 1; region <= numRegions; region++) {
+      const OutliningPlan::Region& regionPlan = plan.regions[region - 1];
+      returns[region] = findReturns(bounds[region - 1]);
+      layouts[region] = CommBlockLayout::pack(oldFunction,
+                                              regionPlan.inputs,
+                                              regionPlan.outputs,
+                                              returns[region].withValue);
+      if (layouts[region].size > 0 && !getModule()->memory.exists) {
+        throw std::runtime_error(
+          fmt::format("Outlining region {} in {} needs a memory for its comm "
+                      "block",
+                      region,
+                      oldFunction->name.c_str()));
+      }
+      WNDPE_LOG(Debug,
+                "Comm block of {} region {}: {} inputs, {} outputs, {} "
+                "bytes\n",
+                oldFunction->name.c_str(),
+                region,
+                regionPlan.inputs.size(),
+                regionPlan.outputs.size(),
+                layouts[region].size);
+      if (stats) {
+        stats->commBlockBytes += layouts[region].size;
+      }
+    }
+
+    // Later siblings first, so rewriting a region doesn't move the markers of
+    // the ones still to be processed.
+    wndpe::ScopedTimer copyTimer(stats ? &stats->copySeconds : nullptr);
+    poolClasses = 0;
+    // Each region's outlined function, followed by its batched variant if it
+    // has one.
+    std::vector<std::vector<std::unique_ptr<Function>>> generated(numRegions);
+    // Computed for the output cache as well, a later run may need them.
+    std::vector<wndpe::RegionFootprint> footprints;
+    if (!staging->footprints.empty() || staging->outputCache) {
+      footprints.resize(numRegions);
+    }
+    for (Index region = numRegions; region >= 1; region--) {
+      const RegionBounds& regionBounds = bounds[region - 1];
+      const CommBlockLayout& layout = layouts[region];
+      Name newFnName = fmt::format(
+        "{}$outlined${}", oldFunction->name.c_str(), region - 1);
+      auto newFunction = makeOutlinedFunction(
+        oldFunction, numLocals, regionBounds, layout, newFnName);
+      Signature outlinedSig = newFunction->getSig();
+      if (stats) {
+        stats->expressionsCopied += Measurer::measure(newFunction->body);
+      }
+      generated[region - 1].push_back(std::move(newFunction));
+      if (!footprints.empty()) {
+        std::vector<Expression*> code;
+        for (Index i = regionBounds.begin + 1; i < regionBounds.end; i++) {
+          code.push_back(regionBounds.parent->list[i]);
+        }
+        footprints[region - 1] = computeRegionFootprint(code, layout);
+        footprints[region - 1].function = newFnName.c_str();
+      }
+      if (Expression** loopSlot =
+            findBatchableLoop(oldFunction,
+                              regionBounds,
+                              plan.regions[region - 1],
+                              returns[region])) {
+        Name batchFnName = fmt::format("{}$batch", newFnName.c_str());
+        auto batchFunction =
+          makeBatchFunction(batchFnName, newFnName, outlinedSig, layout);
+        rewriteBatched(oldFunction,
+                       regionBounds,
+                       layout,
+                       loopSlot,
+                       batchFnName,
+                       outlinedSig);
+        generated[region - 1].push_back(std::move(batchFunction));
+        if (stats) {
+          stats->batchedRegions++;
+        }
+      } else {
+        rewriteMainPath(oldFunction,
+                        regionBounds,
+                        layout,
+                        returns[region],
+                        newFnName,
+                        outlinedSig);
+      }
+    }
+    ReFinalize().walkFunctionInModule(oldFunction, getModule());
+    staging->poolClasses[slot] = poolClasses;
+    for (auto& functions : generated) {
+      for (auto& func : functions) {
+        staging->generated[slot].push_back(std::move(func));
+      }
+    }
+    if (stats) {
+      stats->regions = numRegions;
+      stats->basicBlocks = basicBlocks.size();
+    }
+    if (staging->outputCache) {
+      saveOutput(oldFunction, slot, *stats, footprints);
+    }
+    if (!staging->footprints.empty()) {
+      staging->footprints[slot] = std::move(footprints);
+    }
+  }
+
+  // An output cache entry is a module holding the generated functions and
+  // the rewritten function, in that order, with imports for everything else
+  // they refer to, after the pool classes, the counters and the footprints
+  // of the regions (see writeFootprints):
+  //
+  //   pool <classes>
+  //   stats <regions> <basic blocks> <copied> <comm bytes> <batched>
+  //   footprints <count>
+  //   ...
+  //   (module ...)
+  void saveOutput(Function* func,
+                  Index slot,
+                  const wndpe::FunctionStats& stats,
+                  const std::vector<wndpe::RegionFootprint>& footprints) {
+    Module& wasm = *getModule();
+    Module output;
+    output.features = wasm.features;
+    if (wasm.memory.exists) {
+      output.memory.exists = true;
+      output.memory.name = wasm.memory.name;
+      output.memory.initial = wasm.memory.initial;
+      output.memory.max = wasm.memory.max;
+      output.memory.shared = wasm.memory.shared;
+      output.memory.indexType = wasm.memory.indexType;
+      output.memory.module = "env";
+      output.memory.base = "memory";
+    }
+    for (auto& generated : staging->generated[slot]) {
+      ModuleUtils::copyFunction(generated.get(), output);
+    }
+    ModuleUtils::copyFunction(func, output);
+
+    struct ReferenceFinder
+      : public PostWalker<ReferenceFinder,
+                          UnifiedExpressionVisitor<ReferenceFinder>> {
+      std::set<Name> functions;
+      std::set<Name> globals;
+      std::set<Name> tables;
+      // Signatures of the call sites, for the intrinsics and pool functions
+      // the module doesn't have yet.
+      std::map<Name, Signature> callSignatures;
+
+      void visitExpression(Expression* curr) {
+        if (auto* call = curr->dynCast<Call>()) {
+          functions.insert(call->target);
+          std::vector<Type> params;
+          for (Expression* operand : call->operands) {
+            params.push_back(operand->type);
+          }
+          callSignatures.try_emplace(call->target,
+                                     Signature(Type(params), call->type));
+        } else if (auto* ref = curr->dynCast<RefFunc>()) {
+          functions.insert(ref->func);
+        } else if (auto* get = curr->dynCast<GlobalGet>()) {
+          globals.insert(get->name);
+        } else if (auto* set = curr->dynCast<GlobalSet>()) {
+          globals.insert(set->name);
+        } else if (auto* call = curr->dynCast<CallIndirect>()) {
+          tables.insert(call->table);
+        } else if (auto* get = curr->dynCast<TableGet>()) {
+          tables.insert(get->table);
+        } else if (auto* set = curr->dynCast<TableSet>()) {
+          tables.insert(set->table);
+        } else if (auto* size = curr->dynCast<TableSize>()) {
+          tables.insert(size->table);
+        } else if (auto* grow = curr->dynCast<TableGrow>()) {
+          tables.insert(grow->table);
+        }
+      }
+    } finder;
+    for (auto& defined : output.functions) {
+      finder.walk(defined->body);
+    }
+    for (Name name : finder.functions) {
+      if (output.getFunctionOrNull(name)) {
+        continue;
+      }
+      std::optional<HeapType> type;
+      if (Function* existing = wasm.getFunctionOrNull(name)) {
+        type = existing->type;
+      } else if (auto call = finder.callSignatures.find(name);
+                 call != finder.callSignatures.end()) {
+        type = HeapType(call->second);
+      }
+      if (!type) {
+        return;
+      }
+      auto import = Builder::makeFunction(name, *type, {});
+      import->module = "env";
+      import->base = name;
+      output.addFunction(std::move(import));
+    }
+    for (Name name : finder.globals) {
+      Global* existing = wasm.getGlobalOrNull(name);
+      if (!existing) {
+        return;
+      }
+      auto mutability =
+        existing->mutable_ ? Builder::Mutable : Builder::Immutable;
+      auto import =
+        Builder::makeGlobal(name, existing->type, nullptr, mutability);
+      import->module = "env";
+      import->base = name;
+      output.addGlobal(std::move(import));
+    }
+    for (Name name : finder.tables) {
+      Table* existing = wasm.getTableOrNull(name);
+      if (!existing) {
+        return;
+      }
+      auto import = Builder::makeTable(
+        name, existing->type, existing->initial, existing->max);
+      import->module = "env";
+      import->base = name;
+      output.addTable(std::move(import));
+    }
+    // Anything else the code refers to (tags, data or element segments)
+    // isn't carried over, such functions simply aren't cached.
+    if (!WasmValidator().validate(
+          output, WasmValidator::Globally | WasmValidator::Quiet)) {
+      WNDPE_LOG(Debug,
+                "Not caching the output of {}, it depends on more of the "
+                "module\n",
+                func->name.c_str());
+      return;
+    }
+    std::ostringstream text;
+    text << "pool " << staging->poolClasses[slot] << "\nstats "
+         << stats.regions << ' ' << stats.basicBlocks << ' '
+         << stats.expressionsCopied << ' ' << stats.commBlockBytes << ' '
+         << stats.batchedRegions << '\n';
+    writeFootprints(text, footprints);
+    text << output;
+    staging->outputCache->storeOutput(staging->outputKeys[slot], text.str());
+  }
+
+  // Replaces the function with its cached output and stages the generated
+  // functions. Returns false, leaving everything untouched, if there is no
+  // entry or it doesn't fit the module.
+  bool
+  restoreOutput(Function* func, Index slot, wndpe::FunctionStats* stats) {
+    auto text = staging->outputCache->loadOutput(staging->outputKeys[slot]);
+    if (!text) {
+      return false;
+    }
+    std::istringstream in(*text);
+    std::string word;
+    CommPoolClasses classes = 0;
+    wndpe::FunctionStats cached;
+    if (!(in >> word >> classes) || word != "pool" || !(in >> word) ||
+        word != "stats" ||
+        !(in >> cached.regions >> cached.basicBlocks >>
+          cached.expressionsCopied >> cached.commBlockBytes >>
+          cached.batchedRegions)) {
+      return false;
+    }
+    std::vector<wndpe::RegionFootprint> footprints;
+    if (!readFootprints(in, footprints)) {
+      return false;
+    }
+    std::string moduleText{std::istreambuf_iterator<char>(in), {}};
+    std::unique_ptr<Module> output;
+    try {
+      output = wndpe::loadModule(std::as_bytes(std::span(moduleText)));
+    } catch (const wndpe::ModuleError& e) {
+      WNDPE_LOG(Debug,
+                "Ignoring the cached output of {}: {}\n",
+                func->name.c_str(),
+                e.what());
+      return false;
+    }
+    if (!fitsModule(*output)) {
+      return false;
+    }
+    // The original locals come first, a different layout can only come
+    // from a hash collision.
+    Function* rewritten = output->getFunctionOrNull(func->name);
+    if (!rewritten || rewritten->imported() || rewritten->type != func->type ||
+        rewritten->getNumLocals() < func->getNumLocals()) {
+      return false;
+    }
+    for (Index i = 0; i < func->getNumLocals(); i++) {
+      if (rewritten->getLocalType(i) != func->getLocalType(i)) {
+        return false;
+      }
+    }
+
+    Module& wasm = *getModule();
+    for (auto& cachedFunction : output->functions) {
+      if (cachedFunction->imported() || cachedFunction.get() == rewritten) {
+        continue;
+      }
+      auto generated = Builder::makeFunction(
+        cachedFunction->name,
+        cachedFunction->type,
+        std::vector<Type>(cachedFunction->vars),
+        ExpressionManipulator::copy(cachedFunction->body, wasm));
+      generated->localNames = cachedFunction->localNames;
+      generated->localIndices = cachedFunction->localIndices;
+      staging->generated[slot].push_back(std::move(generated));
+    }
+    func->body = ExpressionManipulator::copy(rewritten->body, wasm);
+    func->vars = rewritten->vars;
+    func->localNames = rewritten->localNames;
+    func->localIndices = rewritten->localIndices;
+    staging->poolClasses[slot] = classes;
+    if (!staging->footprints.empty()) {
+      staging->footprints[slot] = std::move(footprints);
+    }
+    if (stats) {
+      stats->regions = cached.regions;
+      stats->basicBlocks = cached.basicBlocks;
+      stats->expressionsCopied = cached.expressionsCopied;
+      stats->commBlockBytes = cached.commBlockBytes;
+      stats->batchedRegions = cached.batchedRegions;
+    }
+    return true;
+  }
+
+  // Whether the imports of a cached output mean the same in this module.
+  // Functions the module doesn't have are the intrinsics and pool functions
+  // added after the rewrite: the code calling them is unchanged, so they
+  // were missing when the entry was stored as well.
+  bool fitsModule(const Module& output) {
+    Module& wasm = *getModule();
+    for (auto& cachedFunction : output.functions) {
+      if (!cachedFunction->imported()) {
+        continue;
+      }
+      Function* existing = wasm.getFunctionOrNull(cachedFunction->name);
+      if (existing && existing->type != cachedFunction->type) {
+        return false;
+      }
+    }
+    for (auto& cachedGlobal : output.globals) {
+      Global* existing = wasm.getGlobalOrNull(cachedGlobal->name);
+      if (!existing || existing->type != cachedGlobal->type ||
+          existing->mutable_ != cachedGlobal->mutable_) {
+        return false;
+      }
+    }
+    for (auto& cachedTable : output.tables) {
+      Table* existing = wasm.getTableOrNull(cachedTable->name);
+      if (!existing || existing->type != cachedTable->type) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Builds the CFG and finds the locals crossing the boundary of each region.
+  // Returns false if the function turns out to have nothing to outline.
+  bool analyzeFunction(Function* oldFunction, OutliningPlan& plan) {
     Parent::doWalkFunction(oldFunction);
     if (basicBlocks.empty() || this->entry == nullptr) {
-      return;
+      return false;
     }
     if (!needsOutlining) {
-      return;
+      return false;
+    }
+    if (walkingRegion != 0) {
+      throw std::runtime_error(
+        fmt::format("Outlining begin marker in {} has no matching end marker",
+                    oldFunction->name.c_str()));
     }
-    fmt::print(stderr, "Will outline {}\n", oldFunction->name.c_str());
 
-    // Mark basic blocks as on/off/both paths
-    BasicBlock *outliningEntryBlock{}, *outliningExitBlock{};
+    // Mark basic blocks as on/off/both paths, and find the first block of
+    // each region and the block following its end marker (1-based).
+    std::vector<BasicBlock*> regionEntryBlocks(numRegions + 1);
+    std::vector<BasicBlock*> regionExitBlocks(numRegions + 1);
     {
       struct BBWalkEntry {
         BasicBlock* bb;
-        bool onOutlinedPath;
+        // Region the path is in, 0 on the main path.
+        Index region;
       };
       std::vector<BBWalkEntry> remaining;
       remaining.reserve(16);
-      remaining.emplace_back(entry, false);
+      remaining.emplace_back(entry, 0);
       while (!remaining.empty()) {
         BBWalkEntry e = remaining.back();
         remaining.pop_back();
@@ -122,154 +831,894 @@ struct NdpOutliningPass
             "Same basic block has both begin and end outlining markers, check "
             "pass run order");
         }
-        if (e.onOutlinedPath) {
+        // The block following a begin marker is the first one of the region,
+        // the block following an end marker is back on the main path.
+        Index region = e.region;
+        if (info.hasBeginDirectly && e.region == 0) {
+          regionEntryBlocks[info.region] = e.bb;
+          region = info.region;
+        } else if (info.hasEndDirectly && e.region == info.endsRegion) {
+          regionExitBlocks[info.endsRegion] = e.bb;
+          region = 0;
+        }
+        if (region != info.region) {
+          throw std::runtime_error(
+            fmt::format("Control flow crosses the boundary of outlining "
+                        "region {} in {}, only returns may leave it before "
+                        "the end marker",
+                        region != 0 ? region : info.region,
+                        oldFunction->name.c_str()));
+        }
+        if (region != 0) {
           if (info.onOutlinedPath) {
             continue;
           }
           info.onOutlinedPath = true;
-          for (BasicBlock* out : e.bb->out) {
-            remaining.emplace_back(out, !info.hasEndDirectly);
-          }
         } else {
           if (info.onMainPath) {
             continue;
           }
           info.onMainPath = true;
-          for (BasicBlock* out : e.bb->out) {
-            remaining.emplace_back(
-              out, info.hasBeginDirectly && !info.hasEndDirectly);
-          }
+        }
+        for (BasicBlock* out : e.bb->out) {
+          remaining.emplace_back(out, region);
         }
         if (info.node != nullptr) {
-          std::string bname = getExpressionName(info.node);
-          if (Block* b = info.node->dynCast<Block>(); b && !b->name.isNull()) {
-            bname = b->name.c_str();
-          }
-          fmt::print(stderr,
-                     "Visiting BB {} begin:{} end:{}\n",
-                     bname,
-                     info.hasBeginDirectly,
-                     info.hasEndDirectly);
-        }
-        if (info.hasBeginDirectly && !e.onOutlinedPath) {
-          if (outliningEntryBlock != nullptr) {
-            throw std::runtime_error("Found multiple outlining entry markers");
-          }
-          outliningEntryBlock = e.bb;
+          WNDPE_LOG(Trace,
+                    "Visiting BB {} region:{} begin:{} end:{}\n",
+                    getBlockName(info),
+                    info.region,
+                    info.hasBeginDirectly,
+                    info.hasEndDirectly);
         }
-        if (info.hasEndDirectly && e.onOutlinedPath) {
-          if (outliningExitBlock != nullptr) {
-            throw std::runtime_error("Found multiple outlining exit markers");
-          }
-          outliningExitBlock = e.bb;
+      }
+    }
+    for (Index region = 1; region <= numRegions; region++) {
+      if (regionEntryBlocks[region] == nullptr ||
+          regionExitBlocks[region] == nullptr) {
+        throw std::runtime_error(
+          fmt::format("Outlining region {} in {} is not reachable from its "
+                      "begin marker to its end marker",
+                      region,
+                      oldFunction->name.c_str()));
+      }
+    }
+
+    if (wndpe::isLogEnabled(wndpe::LogLevel::Trace)) {
+      for (auto& bb : basicBlocks) {
+        if (!bb || !bb->contents.node) {
+          continue;
         }
+        const BlockInfo& info = bb->contents;
+        WNDPE_LOG(Trace,
+                  "BB-info {} begin:{} end:{} onMain:{} onOutline:{}\n",
+                  getBlockName(info),
+                  info.hasBeginDirectly,
+                  info.hasEndDirectly,
+                  info.onMainPath,
+                  info.onOutlinedPath);
       }
     }
 
-    // give debug names
-    for (auto& bb : basicBlocks) {
-      if (!bb) {
-        continue;
+    // Only locals live across the markers travel through the comm block.
+    Index numLocals = oldFunction->getNumLocals();
+    auto liveIn = computeLiveIn(numLocals, [](BasicBlock*) { return true; });
+    plan.numLocals = numLocals;
+    plan.regions.resize(numRegions);
+    for (Index region = 1; region <= numRegions; region++) {
+      computeRegionLiveness(oldFunction,
+                            region,
+                            regionEntryBlocks[region],
+                            regionExitBlocks[region],
+                            liveIn,
+                            plan.regions[region - 1].inputs,
+                            plan.regions[region - 1].outputs);
+    }
+    return true;
+  }
+
+  static std::string getBlockName(const BlockInfo& info) {
+    if (Block* b = info.node->dynCast<Block>(); b && !b->name.isNull()) {
+      return b->name.c_str();
+    }
+    return getExpressionName(info.node);
+  }
+
+  // Copies the code between the markers into a new function.
+  // arguments: comm block ptr, size
+  // returns: i32: did it do an early return
+  // The first numLocals locals of the original function follow the two
+  // arguments.
+  std::unique_ptr<Function>
+  makeOutlinedFunction(Function* oldFunction,
+                       Index numLocals,
+                       const RegionBounds& bounds,
+                       const CommBlockLayout& layout,
+                       Name newFnName) {
+    Builder builder(*getModule());
+    auto ptrType = getPointerType(*getModule());
+    constexpr Index commBlockPtrLocal = 0;
+    constexpr Index localShift = 2;
+    std::vector<NameType> args;
+    args.emplace_back("comm_block_ptr", ptrType);
+    args.emplace_back("comm_block_size", ptrType);
+    std::vector<NameType> vars;
+    for (Index i = 0; i < numLocals; i++) {
+      vars.emplace_back(oldFunction->getLocalNameOrGeneric(i),
+                        oldFunction->getLocalType(i));
+    }
+    std::unique_ptr<Function> newFunction =
+      builder.makeFunction(newFnName,
+                           std::move(args),
+                           Signature(Type{ptrType, ptrType}, Type::i32),
+                           std::move(vars),
+                           builder.makeBlock());
+    // Copy only the code between the markers, the path marks guarantee it's
+    // all that's reachable from the begin marker.
+    ExpressionManipulator::CustomCopier copier =
+      [&](Expression* e) -> Expression* {
+      if (LocalGet* get = e->dynCast<LocalGet>()) {
+        return builder.makeLocalGet(get->index + localShift, get->type);
+      } else if (LocalSet* set = e->dynCast<LocalSet>()) {
+        Expression* value =
+          ExpressionManipulator::flexibleCopy(set->value, *getModule(), copier);
+        if (set->isTee()) {
+          return builder.makeLocalTee(
+            set->index + localShift, value, set->type);
+        }
+        return builder.makeLocalSet(set->index + localShift, value);
+      } else if (Return* ret = e->dynCast<Return>()) {
+        Expression* early = builder.makeReturn(builder.makeConst<int32_t>(1));
+        if (ret->value == nullptr) {
+          return early;
+        }
+        return builder.makeSequence(
+          layout.makeResultStore(builder,
+                                 commBlockPtrLocal,
+                                 ptrType,
+                                 ExpressionManipulator::flexibleCopy(
+                                   ret->value, *getModule(), copier)),
+          early);
       }
-      BlockInfo& info = bb->contents;
-      if (!info.node) {
-        continue;
+      return nullptr;
+    };
+    std::vector<Expression*> body;
+    body.push_back(layout.makeDeserialize(
+      builder, CommDirection::Inputs, commBlockPtrLocal, ptrType, localShift));
+    for (Index i = bounds.begin + 1; i < bounds.end; i++) {
+      body.push_back(ExpressionManipulator::flexibleCopy(
+        bounds.parent->list[i], *getModule(), copier));
+    }
+    body.push_back(layout.makeSerialize(
+      builder, CommDirection::Outputs, commBlockPtrLocal, ptrType, localShift));
+    body.push_back(builder.makeConst<int32_t>(0));
+    newFunction->body = builder.makeBlock(body, wasm::Type::i32);
+    return newFunction;
+  }
+
+  // Replaces the markers and everything between them with an offload of the
+  // outlined function:
+  //
+  //   comm = alloc(size); <store inputs>
+  //   if (outline_call(outlined, comm, size)) {
+  //     result = <load result>; free(comm); return result;
+  //   }
+  //   <load outputs>; free(comm)
+  //
+  // The flag is dropped if the region never returns.
+  void rewriteMainPath(Function* func,
+                       const RegionBounds& bounds,
+                       const CommBlockLayout& layout,
+                       const RegionReturns& returns,
+                       Name outlinedName,
+                       Signature outlinedSig) {
+    Builder builder(*getModule());
+    Type ptrType = getPointerType(*getModule());
+    auto makeSize = [&]() {
+      return builder.makeConst(Literal::makeFromInt64(layout.size, ptrType));
+    };
+
+    // An empty layout needs no memory at all, a null pointer is passed.
+    bool needsBlock = layout.size > 0;
+    Index commLocal = needsBlock ? Builder::addVar(func, ptrType) : Index(-1);
+    auto makeCommPtr = [&]() -> Expression* {
+      if (needsBlock) {
+        return builder.makeLocalGet(commLocal, ptrType);
+      }
+      return builder.makeConst(Literal::makeFromInt64(0, ptrType));
+    };
+    auto makeFree = [&]() -> Expression* {
+      if (needsBlock) {
+        return makeCommBlockFree(builder, makeCommPtr(), layout.size);
+      }
+      return builder.makeNop();
+    };
+
+    std::vector<Expression*> offload;
+    if (needsBlock) {
+      offload.push_back(builder.makeLocalSet(
+        commLocal, makeCommBlockAlloc(builder, ptrType, layout.size)));
+      offload.push_back(layout.makeSerialize(
+        builder, CommDirection::Inputs, commLocal, ptrType));
+    }
+
+    Expression* call =
+      builder.makeCall(intrnOutlineCall,
+                       {builder.makeRefFunc(outlinedName, outlinedSig),
+                        makeCommPtr(),
+                        makeSize()},
+                       Type::i32);
+    if (!returns.any) {
+      offload.push_back(builder.makeDrop(call));
+    } else if (const CommSlot* resultSlot = layout.getResultSlot()) {
+      Index resultLocal = Builder::addVar(func, resultSlot->type);
+      Expression* result = layout.makeResultLoad(builder, commLocal, ptrType);
+      offload.push_back(builder.makeIf(
+        call,
+        builder.makeBlock(
+          {builder.makeLocalSet(resultLocal, result),
+           makeFree(),
+           builder.makeReturn(
+             builder.makeLocalGet(resultLocal, resultSlot->type))})));
+    } else {
+      offload.push_back(builder.makeIf(
+        call, builder.makeSequence(makeFree(), builder.makeReturn())));
+    }
+
+    if (needsBlock) {
+      offload.push_back(layout.makeDeserialize(
+        builder, CommDirection::Outputs, commLocal, ptrType));
+      offload.push_back(makeFree());
+    }
+
+    auto& list = bounds.parent->list;
+    std::vector<Expression*> newList;
+    newList.reserve(list.size() - (bounds.end - bounds.begin));
+    for (Index i = 0; i < bounds.begin; i++) {
+      newList.push_back(list[i]);
+    }
+    newList.push_back(builder.makeBlock(offload));
+    for (Index i = bounds.end + 1; i < list.size(); i++) {
+      newList.push_back(list[i]);
+    }
+    list.set(newList);
+  }
+
+  // Offloads of a region that makes up a loop body together with code that
+  // only shuffles locals can be deferred and sent in batches: the region
+  // reads its inputs from a snapshot, and deferring it past the rest of the
+  // loop changes nothing the loop can observe as long as
+  //  - the module has a memory for the batch,
+  //  - the region never returns (the host would have to stop iterating),
+  //  - no local is both an input and an output (no loop-carried dependence
+  //    through the comm block),
+  //  - the rest of the body touches no memory, globals or calls, can't trap,
+  //    doesn't touch the outputs and leaves the loop only by falling through
+  //    (so every pending record is flushed right after the loop).
+  // Returns the slot holding the loop, or nullptr.
+  Expression** findBatchableLoop(Function* func,
+                                 const RegionBounds& bounds,
+                                 const OutliningPlan::Region& plan,
+                                 const RegionReturns& returns) {
+    if (staging->batchRecords < 2 || !getModule()->memory.exists ||
+        returns.any) {
+      return nullptr;
+    }
+    for (Index local : plan.inputs) {
+      if (isOutput(plan, local)) {
+        return nullptr;
+      }
+    }
+    auto& list = bounds.parent->list;
+
+    struct LoopFinder : public PostWalker<LoopFinder> {
+      Block* body;
+      Expression** slot = nullptr;
+      void visitLoop(Loop* curr) {
+        if (curr->body == body) {
+          slot = getCurrentPointer();
+        }
       }
-      Block* b = info.node->dynCast<Block>();
-      if (!b) {
+    } finder;
+    finder.body = bounds.parent;
+    finder.walk(func->body);
+    if (!finder.slot) {
+      return nullptr;
+    }
+    Loop* loop = (*finder.slot)->cast<Loop>();
+    if (loop->type != Type::none) {
+      return nullptr;
+    }
+
+    std::unordered_set<Name> targets = {loop->name, bounds.parent->name};
+    for (Index i = 0; i < list.size(); i++) {
+      if (i >= bounds.begin && i <= bounds.end) {
         continue;
       }
-      if (info.onMainPath) {
-        if (b->name.size() == 0) {
-          b->name.set("block");
+      if (!isLocalOnly(list[i], targets)) {
+        return nullptr;
+      }
+      for (LocalGet* get : FindAll<LocalGet>(list[i]).list) {
+        if (isOutput(plan, get->index)) {
+          return nullptr;
+        }
+      }
+      for (LocalSet* set : FindAll<LocalSet>(list[i]).list) {
+        if (isOutput(plan, set->index)) {
+          return nullptr;
+        }
+      }
+    }
+    return finder.slot;
+  }
+
+  static bool isOutput(const OutliningPlan::Region& plan, Index local) {
+    return std::binary_search(plan.outputs.begin(), plan.outputs.end(), local);
+  }
+
+  // Whether curr only computes on locals, can't trap and only branches to
+  // its own labels or to targets.
+  static bool isLocalOnly(Expression* curr,
+                          const std::unordered_set<Name>& targets) {
+    struct Checker
+      : public PostWalker<Checker, UnifiedExpressionVisitor<Checker>> {
+      using Super = PostWalker<Checker, UnifiedExpressionVisitor<Checker>>;
+
+      std::unordered_set<Name> targets;
+      bool ok = true;
+
+      void visitExpression(Expression* curr) {
+        switch (curr->_id) {
+          case Expression::LocalGetId:
+          case Expression::LocalSetId:
+          case Expression::ConstId:
+          case Expression::SelectId:
+          case Expression::DropId:
+          case Expression::NopId:
+          case Expression::IfId:
+          case Expression::BlockId:
+          case Expression::LoopId:
+            return;
+          case Expression::UnaryId:
+            ok = ok && !canTrap(curr->cast<Unary>()->op);
+            return;
+          case Expression::BinaryId:
+            ok = ok && !canTrap(curr->cast<Binary>()->op);
+            return;
+          case Expression::BreakId:
+            ok = ok && targets.count(curr->cast<Break>()->name);
+            return;
+          default:
+            ok = false;
         }
-        std::string new_name = fmt::format("{}_onmainpath", b->name.c_str());
-        b->name.set(new_name.c_str(), false);
       }
-      if (info.onOutlinedPath) {
-        if (b->name.size() == 0) {
-          b->name.set("block");
+
+      static void doPreVisitScope(Checker* self, Expression** currp) {
+        if (auto* block = (*currp)->dynCast<Block>(); block && block->name) {
+          self->targets.insert(block->name);
+        } else if (auto* loop = (*currp)->dynCast<Loop>();
+                   loop && loop->name) {
+          self->targets.insert(loop->name);
         }
-        std::string new_name =
-          fmt::format("{}_onoutlinedpath", b->name.c_str());
-        b->name.set(new_name.c_str(), false);
       }
-      std::string bname = getExpressionName(info.node);
-      if (Block* b = info.node->dynCast<Block>(); b && !b->name.isNull()) {
-        bname = b->name.c_str();
+
+      static void scan(Checker* self, Expression** currp) {
+        self->pushTask(Super::scan, currp);
+        self->pushTask(doPreVisitScope, currp);
       }
-      fmt::print(stderr,
-                 "BB-info {} begin:{} end:{} onMain:{} onOutline:{}\n",
-                 bname,
-                 info.hasBeginDirectly,
-                 info.hasEndDirectly,
-                 info.onMainPath,
-                 info.onOutlinedPath);
+    } checker;
+    checker.targets = targets;
+    checker.walk(curr);
+    return checker.ok;
+  }
+
+  static bool canTrap(UnaryOp op) {
+    switch (op) {
+      case TruncSFloat32ToInt32:
+      case TruncSFloat32ToInt64:
+      case TruncUFloat32ToInt32:
+      case TruncUFloat32ToInt64:
+      case TruncSFloat64ToInt32:
+      case TruncSFloat64ToInt64:
+      case TruncUFloat64ToInt32:
+      case TruncUFloat64ToInt64:
+        return true;
+      default:
+        return false;
     }
+  }
 
-    // duplicate function
-    // arguments: comm block ptr, size
-    // returns: i32: did it do an early return
+  static bool canTrap(BinaryOp op) {
+    switch (op) {
+      case DivSInt32:
+      case DivUInt32:
+      case RemSInt32:
+      case RemUInt32:
+      case DivSInt64:
+      case DivUInt64:
+      case RemSInt64:
+      case RemUInt64:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // Runs the records of a batch one after the other:
+  //
+  //   for (end = ptr + size; ptr < end; ptr += stride) record(ptr, stride)
+  //
+  // Same ABI as the outlined function, none of the records returns early.
+  std::unique_ptr<Function> makeBatchFunction(Name name,
+                                              Name recordFnName,
+                                              Signature sig,
+                                              const CommBlockLayout& layout) {
     Builder builder(*getModule());
-    bool is64bit = getModule()->features.hasMemory64();
-    auto ptrType = is64bit ? wasm::Type::i64 : wasm::Type::i32;
-    Name newFnName = fmt::format("{}$outlined", oldFunction->name.c_str());
-    {
-      std::vector<NameType> args;
-      args.emplace_back("comm_block_ptr", ptrType);
-      args.emplace_back("comm_block_size", ptrType);
-      std::unique_ptr<Function> newFunction =
-        builder.makeFunction(newFnName,
-                             std::move(args),
-                             Signature(Type{ptrType, ptrType}, Type::i32),
-                             {},
-                             builder.makeBlock());
-      //
-      newFunction->body = ExpressionManipulator::flexibleCopy(
-        oldFunction->body, *getModule(), [&](Expression* e) -> Expression* {
-          switch (e->_id) {
-            case Expression::CallId: {
-              Call* call = e->cast<Call>();
-              if (call->target == intrnOutlineBegin) {
-                return builder.makeBlock(intrnOutlineJumpInsideLabel,
-                                         builder.makeNop());
-              } else if (call->target == intrnOutlineEnd) {
-                return builder.makeReturn(builder.makeConst<int32_t>(0));
-              }
-              break;
-            }
-            case Expression::ReturnId: {
-              Return* ret = e->cast<Return>();
-              return builder.makeBlock(
-                {builder.makeDrop(ret->value),
-                 builder.makeReturn(builder.makeConst<int32_t>(1))});
-            }
-            default:
-              break;
-          }
-          return nullptr;
-        });
-      newFunction->body =
-        builder.makeBlock({builder.makeBreak(intrnOutlineJumpInsideLabel),
-                           builder.makeDrop(newFunction->body),
-                           builder.makeConst<int32_t>(1)},
-                          wasm::Type::i32);
-      {
-        std::lock_guard _l(OutliningModuleMutex);
-        getModule()->addFunction(std::move(newFunction));
+    Type ptrType = getPointerType(*getModule());
+    constexpr Index ptrLocal = 0;
+    constexpr Index sizeLocal = 1;
+    constexpr Index endLocal = 2;
+    auto makePtrConst = [&](uint64_t value) {
+      return builder.makeConst(Literal::makeFromInt64(value, ptrType));
+    };
+    auto makePtrGet = [&](Index local) {
+      return builder.makeLocalGet(local, ptrType);
+    };
+    std::vector<NameType> params;
+    params.emplace_back("comm_block_ptr", ptrType);
+    params.emplace_back("comm_block_size", ptrType);
+    std::vector<NameType> vars;
+    vars.emplace_back("comm_block_end", ptrType);
+    uint32_t stride = getRecordStride(layout);
+    Name doneLabel = "batch_done";
+    Name nextLabel = "batch_next";
+    Expression* loop = builder.makeLoop(
+      nextLabel,
+      builder.makeBlock(
+        {builder.makeBreak(
+           doneLabel,
+           nullptr,
+           builder.makeBinary(Abstract::getBinary(ptrType, Abstract::GeU),
+                              makePtrGet(ptrLocal),
+                              makePtrGet(endLocal))),
+         builder.makeDrop(
+           builder.makeCall(recordFnName,
+                            {makePtrGet(ptrLocal), makePtrConst(stride)},
+                            sig.results)),
+         builder.makeLocalSet(
+           ptrLocal,
+           builder.makeBinary(Abstract::getBinary(ptrType, Abstract::Add),
+                              makePtrGet(ptrLocal),
+                              makePtrConst(stride))),
+         builder.makeBreak(nextLabel)}));
+    std::vector<Expression*> body;
+    body.push_back(builder.makeLocalSet(
+      endLocal,
+      builder.makeBinary(Abstract::getBinary(ptrType, Abstract::Add),
+                         makePtrGet(ptrLocal),
+                         makePtrGet(sizeLocal))));
+    body.push_back(builder.makeBlock(doneLabel, loop));
+    body.push_back(builder.makeConst<int32_t>(0));
+    return builder.makeFunction(name,
+                                std::move(params),
+                                sig,
+                                std::move(vars),
+                                builder.makeBlock(body, Type::i32));
+  }
+
+  // Records are the comm block padded to its alignment, an empty block still
+  // takes a byte so the batch size counts the records.
+  static uint32_t getRecordStride(const CommBlockLayout& layout) {
+    uint32_t size = std::max(layout.size, uint32_t(1));
+    return (size + layout.align - 1) / layout.align * layout.align;
+  }
+
+  // Replaces the region with appending a record to the pending batch, and
+  // the loop around it with
+  //
+  //   batch = alloc(records * stride); count = 0; last = 0
+  //   loop {
+  //     ...
+  //     last = batch + count * stride; <store inputs at last>
+  //     if (++count == records) {
+  //       outline_call(batched, batch, count * stride); count = 0
+  //     }
+  //     ...
+  //   }
+  //   if (count) outline_call(batched, batch, count * stride)
+  //   if (last) <load outputs from last>
+  //   free(batch)
+  void rewriteBatched(Function* func,
+                      const RegionBounds& bounds,
+                      const CommBlockLayout& layout,
+                      Expression** loopSlot,
+                      Name batchFnName,
+                      Signature batchSig) {
+    Builder builder(*getModule());
+    Type ptrType = getPointerType(*getModule());
+    uint32_t stride = getRecordStride(layout);
+    uint32_t records = staging->batchRecords;
+    Index batchLocal = Builder::addVar(func, ptrType);
+    Index countLocal = Builder::addVar(func, ptrType);
+    Index recordLocal = Builder::addVar(func, ptrType);
+    auto makePtrConst = [&](uint64_t value) {
+      return builder.makeConst(Literal::makeFromInt64(value, ptrType));
+    };
+    auto makePtrGet = [&](Index local) {
+      return builder.makeLocalGet(local, ptrType);
+    };
+    auto makeBatchSize = [&]() {
+      return builder.makeBinary(Abstract::getBinary(ptrType, Abstract::Mul),
+                                makePtrGet(countLocal),
+                                makePtrConst(stride));
+    };
+    auto makeFlush = [&]() {
+      return builder.makeDrop(
+        builder.makeCall(intrnOutlineCall,
+                         {builder.makeRefFunc(batchFnName, batchSig),
+                          makePtrGet(batchLocal),
+                          makeBatchSize()},
+                         Type::i32));
+    };
+
+    std::vector<Expression*> append;
+    append.push_back(builder.makeLocalSet(
+      recordLocal,
+      builder.makeBinary(Abstract::getBinary(ptrType, Abstract::Add),
+                         makePtrGet(batchLocal),
+                         makeBatchSize())));
+    append.push_back(layout.makeSerialize(
+      builder, CommDirection::Inputs, recordLocal, ptrType));
+    append.push_back(builder.makeLocalSet(
+      countLocal,
+      builder.makeBinary(Abstract::getBinary(ptrType, Abstract::Add),
+                         makePtrGet(countLocal),
+                         makePtrConst(1))));
+    append.push_back(builder.makeIf(
+      builder.makeBinary(Abstract::getBinary(ptrType, Abstract::Eq),
+                         makePtrGet(countLocal),
+                         makePtrConst(records)),
+      builder.makeSequence(
+        makeFlush(), builder.makeLocalSet(countLocal, makePtrConst(0)))));
+
+    auto& list = bounds.parent->list;
+    std::vector<Expression*> newList;
+    newList.reserve(list.size() - (bounds.end - bounds.begin));
+    for (Index i = 0; i < bounds.begin; i++) {
+      newList.push_back(list[i]);
+    }
+    newList.push_back(builder.makeBlock(append));
+    for (Index i = bounds.end + 1; i < list.size(); i++) {
+      newList.push_back(list[i]);
+    }
+    list.set(newList);
+
+    std::vector<Expression*> wrapped;
+    wrapped.push_back(builder.makeLocalSet(
+      batchLocal,
+      makeCommBlockAlloc(builder, ptrType, uint64_t(records) * stride)));
+    wrapped.push_back(builder.makeLocalSet(countLocal, makePtrConst(0)));
+    wrapped.push_back(builder.makeLocalSet(recordLocal, makePtrConst(0)));
+    wrapped.push_back(*loopSlot);
+    wrapped.push_back(builder.makeIf(
+      builder.makeBinary(Abstract::getBinary(ptrType, Abstract::Ne),
+                         makePtrGet(countLocal),
+                         makePtrConst(0)),
+      makeFlush()));
+    wrapped.push_back(builder.makeIf(
+      builder.makeBinary(Abstract::getBinary(ptrType, Abstract::Ne),
+                         makePtrGet(recordLocal),
+                         makePtrConst(0)),
+      layout.makeDeserialize(
+        builder, CommDirection::Outputs, recordLocal, ptrType)));
+    wrapped.push_back(makeCommBlockFree(
+      builder, makePtrGet(batchLocal), uint64_t(records) * stride));
+    *loopSlot = builder.makeBlock(wrapped);
+  }
+
+  // Comm blocks come from the in-module pool unless it's disabled.
+  Expression*
+  makeCommBlockAlloc(Builder& builder, Type ptrType, uint64_t size) {
+    if (!staging->commPool) {
+      return builder.makeCall(
+        intrnOutlineAlloc,
+        {builder.makeConst(Literal::makeFromInt64(size, ptrType))},
+        ptrType);
+    }
+    return wasm::makeCommBlockAlloc(builder, ptrType, size, poolClasses);
+  }
+
+  Expression*
+  makeCommBlockFree(Builder& builder, Expression* ptr, uint64_t size) {
+    if (!staging->commPool) {
+      return builder.makeCall(intrnOutlineFree, {ptr}, Type::none);
+    }
+    return wasm::makeCommBlockFree(builder, ptr, size, poolClasses);
+  }
+
+  // See hasTailCall.
+  void checkNoTailCalls(Function* func,
+                        const RegionBounds& bounds,
+                        Index region) {
+    for (Index i = bounds.begin + 1; i < bounds.end; i++) {
+      if (hasTailCall(bounds.parent->list[i])) {
+        throw std::runtime_error(
+          fmt::format("Outlining region {} in {} contains a tail call, which "
+                      "can't leave an outlined region",
+                      region,
+                      func->name.c_str()));
+      }
+    }
+  }
+
+  // Returns the bounds of every region, in the walk order of their begin
+  // markers (the same order the CFG walk numbers them in).
+  std::vector<RegionBounds> findRegions(Function* func) {
+    struct MarkerFinder : public ExpressionStackWalker<MarkerFinder> {
+      Name beginName, endName;
+      std::vector<RegionBounds> regions;
+      bool misplaced = false;
+
+      void visitCall(Call* curr) {
+        bool isBegin = curr->target == beginName;
+        if (!isBegin && curr->target != endName) {
+          return;
+        }
+        Block* parent = nullptr;
+        if (expressionStack.size() >= 2) {
+          parent =
+            expressionStack[expressionStack.size() - 2]->dynCast<Block>();
+        }
+        if (!parent) {
+          misplaced = true;
+          return;
+        }
+        Index index = 0;
+        while (parent->list[index] != curr) {
+          index++;
+        }
+        if (isBegin) {
+          regions.push_back(RegionBounds{parent, index, index});
+        } else if (!regions.empty() && regions.back().parent == parent &&
+                   regions.back().end == regions.back().begin) {
+          regions.back().end = index;
+        } else {
+          misplaced = true;
+        }
       }
+    } finder;
+    finder.beginName = intrnOutlineBegin;
+    finder.endName = intrnOutlineEnd;
+    finder.walk(func->body);
+
+    if (finder.misplaced || finder.regions.size() != numRegions) {
+      throw std::runtime_error(
+        fmt::format("Outlining begin and end markers in {} must be siblings "
+                    "in the same block, in that order",
+                    func->name.c_str()));
     }
+    for (const RegionBounds& region : finder.regions) {
+      if (region.end == region.begin) {
+        throw std::runtime_error(
+          fmt::format("Outlining begin marker in {} has no matching end marker "
+                      "in the same block",
+                      func->name.c_str()));
+      }
+    }
+    return finder.regions;
   }
 
 private:
-  Name intrnOutlineJumpInsideLabel = "__wndpe_outlined_start_target";
-  Name intrnOutlineBegin = "__wndpe_outline_begin";
-  Name intrnOutlineEnd = "__wndpe_outline_end";
-  Name intrnOutlineCall = "__wndpe_outline_call";
-  Name intrnOutlineAlloc = "__wndpe_outline_alloc";
-  Name intrnOutlineFree = "__wndpe_outline_free";
+  Name intrnOutlineBegin = IntrinsicOutlineBegin;
+  Name intrnOutlineEnd = IntrinsicOutlineEnd;
+  Name intrnOutlineCall = IntrinsicOutlineCall;
+  Name intrnOutlineAlloc = IntrinsicOutlineAlloc;
+  Name intrnOutlineFree = IntrinsicOutlineFree;
+};
+
+// Calls work with the index of every function of the module, on binaryen's
+// thread pool unless it's busy or has a single thread.
+template<typename Work>
+void forEachFunctionInParallel(Module& wasm, Work work) {
+  Index numFunctions = wasm.functions.size();
+  ThreadPool* pool = ThreadPool::get();
+  if (ThreadPool::isRunning() || pool->size() <= 1) {
+    for (Index i = 0; i < numFunctions; i++) {
+      work(i);
+    }
+    return;
+  }
+  std::atomic<Index> next = 0;
+  std::vector<std::function<ThreadWorkState()>> workers(
+    pool->size(), [&]() {
+      Index i = next++;
+      if (i >= numFunctions) {
+        return ThreadWorkState::Finished;
+      }
+      work(i);
+      return ThreadWorkState::More;
+    });
+  pool->work(workers);
+}
+
+// Runs NdpOutliningPass over all functions in parallel, then adds the
+// generated functions to the module.
+struct NdpOutliningDriverPass : public Pass {
+  wndpe::Stats* stats;
+  // Empty: no plan cache.
+  std::filesystem::path cacheDir;
+  wndpe::OutliningReport* report;
+  uint32_t batchRecords;
+  bool commPool;
+
+  explicit NdpOutliningDriverPass(const wndpe::OutliningOptions& options)
+    : stats(options.stats), cacheDir(options.cacheDir),
+      report(options.report), batchRecords(options.batchRecords),
+      commPool(options.commPool) {}
+
+  void run(PassRunner* runner, Module* module) override {
+    if (!module->getFunctionOrNull(IntrinsicOutlineBegin)) {
+      return;
+    }
+
+    // Markers are typically in a handful of functions out of many thousands,
+    // find them with a cheap scan before paying for any CFG. The cache key
+    // has to be taken before the body is rewritten.
+    struct MarkerScan {
+      bool hasMarkers = false;
+      uint64_t key = 0;
+      uint64_t outputKey = 0;
+    };
+    std::optional<PlanCache> cache;
+    if (!cacheDir.empty()) {
+      cache.emplace(cacheDir);
+    }
+    // Entries are module text, which binaryen prints with color codes when
+    // they are enabled.
+    bool cacheOutputs = cache && !Colors::isEnabled();
+    // Everything besides the function that changes what the rewrite makes
+    // of it.
+    std::string outputContext =
+      fmt::format("{} {} {} {}",
+                  getPointerType(*module).toString(),
+                  module->memory.exists,
+                  batchRecords,
+                  commPool);
+    // Indexed by position in the module, so the only allocation is this
+    // vector.
+    std::vector<MarkerScan> scans(module->functions.size());
+    forEachFunctionInParallel(*module, [&](Index i) {
+      Function* func = module->functions[i].get();
+      MarkerScan& scan = scans[i];
+      scan.hasMarkers = hasOutliningMarkers(func);
+      if (scan.hasMarkers && cache) {
+        scan.key = hashFunctionContents(func);
+      }
+      if (scan.hasMarkers && cacheOutputs) {
+        scan.outputKey = hashFunctionOutput(func, outputContext);
+      }
+    });
+    OutliningStaging staging;
+    staging.batchRecords = batchRecords;
+    staging.commPool = commPool;
+    std::vector<Function*> markedFunctions;
+    for (Index i = 0; i < scans.size(); i++) {
+      const MarkerScan& scan = scans[i];
+      if (scan.hasMarkers) {
+        Function* func = module->functions[i].get();
+        staging.functionIndices[func] = staging.generated.size();
+        markedFunctions.push_back(func);
+        staging.generated.emplace_back();
+        staging.keys.push_back(scan.key);
+        staging.outputKeys.push_back(scan.outputKey);
+      }
+    }
+    if (staging.generated.empty()) {
+      return;
+    }
+    // Before anything is rewritten, so a clash leaves the module untouched.
+    try {
+      checkOutliningIntrinsics(*module);
+      if (commPool) {
+        checkCommPoolNames(*module);
+      }
+    } catch (const std::runtime_error& e) {
+      throw wndpe::ModuleError(e.what());
+    }
+    staging.plans.resize(staging.generated.size());
+    staging.cachedPlans.resize(staging.generated.size());
+    staging.poolClasses.resize(staging.generated.size());
+    staging.errors.resize(staging.generated.size());
+    staging.cachedOutputs.resize(staging.generated.size());
+    if (cacheOutputs) {
+      staging.outputCache = &*cache;
+    }
+    if (cache) {
+      for (size_t i = 0; i < staging.keys.size(); i++) {
+        // A plan for a different number of locals can only come from a hash
+        // collision, analyze the function afresh.
+        auto plan = cache->load(staging.keys[i]);
+        if (plan && plan->numLocals == markedFunctions[i]->getNumLocals()) {
+          staging.plans[i] = std::move(*plan);
+          staging.cachedPlans[i] = true;
+        }
+      }
+    }
+    if (stats) {
+      staging.functionStats.resize(staging.generated.size());
+    }
+    if (report) {
+      staging.footprints.resize(staging.generated.size());
+    }
+
+    PassRunner workers(module, runner->options);
+    workers.setIsNested(true);
+    workers.add(std::make_unique<NdpOutliningPass>(&staging));
+    workers.run();
+    // The module is left half rewritten, callers are expected to drop it.
+    for (auto& error : staging.errors) {
+      if (error) {
+        throw wndpe::ModuleError(*error);
+      }
+    }
+
+    if (cache) {
+      for (size_t i = 0; i < staging.plans.size(); i++) {
+        if (staging.cachedPlans[i] || staging.cachedOutputs[i]) {
+          if (stats) {
+            stats->cacheHits++;
+          }
+        } else if (!staging.plans[i].regions.empty()) {
+          cache->store(staging.keys[i], staging.plans[i]);
+          if (stats) {
+            stats->cacheMisses++;
+          }
+        }
+      }
+    }
+
+    CommPoolClasses poolClasses = 0;
+    bool outlined = false;
+    for (size_t i = 0; i < staging.generated.size(); i++) {
+      for (auto& func : staging.generated[i]) {
+        module->addFunction(std::move(func));
+        outlined = true;
+      }
+      poolClasses |= staging.poolClasses[i];
+    }
+    // A module with markers but nothing to outline keeps its imports.
+    if (outlined) {
+      addOutliningIntrinsics(*module);
+    }
+    addCommPool(*module, poolClasses);
+    if (report) {
+      for (auto& footprints : staging.footprints) {
+        for (auto& footprint : footprints) {
+          report->regions.push_back(std::move(footprint));
+        }
+      }
+    }
+    if (stats) {
+      for (auto& functionStats : staging.functionStats) {
+        stats->phases.cfg += functionStats.cfgSeconds;
+        if (functionStats.regions == 0) {
+          continue;
+        }
+        stats->functionsOutlined++;
+        stats->regions += functionStats.regions;
+        stats->basicBlocks += functionStats.basicBlocks;
+        stats->expressionsCopied += functionStats.expressionsCopied;
+        stats->commBlockBytes += functionStats.commBlockBytes;
+        stats->batchedRegions += functionStats.batchedRegions;
+        stats->phases.copy += functionStats.copySeconds;
+        stats->functions.push_back(std::move(functionStats));
+      }
+    }
+  }
 };
 
-Pass* createNdpOutliningPass() { return new NdpOutliningPass(); }
+Pass* createNdpOutliningPass(const wndpe::OutliningOptions& options) {
+  return new NdpOutliningDriverPass(options);
+}
 
 } // namespace wasm
@@ -0,0 +1,259 @@
+#include "wndpe/PlanCache.h"
+
+#include <atomic>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string_view>
+#include <system_error>
+
+#include <ir/branch-utils.h>
+#include <wasm-traversal.h>
+
+#include <fmt/core.h>
+
+#include "wndpe/Instrumentation.h"
+
+namespace wasm {
+
+namespace {
+
+// Bump whenever the analysis or the entry format changes, so stale entries
+// are never picked up.
+constexpr std::string_view PlanFormat = "wndpe-plan 2";
+// Bump whenever the rewrite changes what it generates.
+constexpr std::string_view OutputFormat = "wndpe-output 1";
+
+struct Fnv1a {
+  uint64_t state = 0xcbf29ce484222325;
+
+  void update(std::string_view bytes) {
+    for (unsigned char c : bytes) {
+      state ^= c;
+      state *= 0x100000001b3;
+    }
+  }
+
+  void update(uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+      state ^= (value >> (i * 8)) & 0xff;
+      state *= 0x100000001b3;
+    }
+  }
+
+  void update(Name name) {
+    update(std::string_view(name.is() ? name.c_str() : ""));
+    update(std::string_view("", 1));
+  }
+};
+
+// Hashes what the liveness analysis depends on: the shape of the tree,
+// expression kinds, local indices, labels and call targets. Constants,
+// operators and memory immediates don't change the plan and are skipped.
+// Names are hashed by contents, unlike in binaryen's own expression hash,
+// so keys are the same in every process.
+struct PlanHasher
+  : public PostWalker<PlanHasher, UnifiedExpressionVisitor<PlanHasher>> {
+  using Super = PostWalker<PlanHasher, UnifiedExpressionVisitor<PlanHasher>>;
+
+  Fnv1a& hash;
+
+  explicit PlanHasher(Fnv1a& hash) : hash(hash) {}
+
+  // Every expression is hashed as ( children kind immediates ), which
+  // tells trees apart that flatten to the same sequence.
+  static void doOpen(PlanHasher* self, Expression** currp) {
+    self->hash.update(std::string_view("("));
+  }
+
+  static void scan(PlanHasher* self, Expression** currp) {
+    Super::scan(self, currp);
+    self->pushTask(doOpen, currp);
+  }
+
+  void visitExpression(Expression* curr) {
+    hash.update(uint64_t(curr->_id));
+    if (auto* get = curr->dynCast<LocalGet>()) {
+      hash.update(uint64_t(get->index));
+    } else if (auto* set = curr->dynCast<LocalSet>()) {
+      hash.update(uint64_t(set->index));
+      hash.update(uint64_t(set->isTee()));
+    } else if (auto* call = curr->dynCast<Call>()) {
+      hash.update(call->target);
+      hash.update(uint64_t(call->isReturn));
+    } else if (auto* call = curr->dynCast<CallIndirect>()) {
+      hash.update(uint64_t(call->isReturn));
+    } else if (auto* call = curr->dynCast<CallRef>()) {
+      hash.update(uint64_t(call->isReturn));
+    }
+    BranchUtils::operateOnScopeNameDefs(
+      curr, [&](Name& name) { hash.update(name); });
+    BranchUtils::operateOnScopeNameUses(
+      curr, [&](Name& name) { hash.update(name); });
+    hash.update(std::string_view(")"));
+  }
+};
+
+void writeIndices(std::ostream& out, const std::vector<Index>& indices) {
+  out << ' ' << indices.size();
+  for (Index i : indices) {
+    out << ' ' << i;
+  }
+}
+
+bool readIndices(std::istream& in, Index numLocals, std::vector<Index>& out) {
+  size_t count = 0;
+  if (!(in >> count) || count > numLocals) {
+    return false;
+  }
+  out.resize(count);
+  for (Index& i : out) {
+    if (!(in >> i) || i >= numLocals) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+uint64_t hashFunctionContents(Function* func) {
+  Fnv1a hash;
+  hash.update(PlanFormat);
+  hash.update(std::string_view(func->getSig().toString()));
+  for (Index i = 0; i < func->getNumLocals(); i++) {
+    hash.update(std::string_view(func->getLocalType(i).toString()));
+  }
+  PlanHasher hasher(hash);
+  hasher.walk(func->body);
+  return hash.state;
+}
+
+uint64_t hashFunctionOutput(Function* func, std::string_view context) {
+  Fnv1a hash;
+  hash.update(OutputFormat);
+  hash.update(context);
+  hash.update(func->name);
+  hash.update(std::string_view(func->getSig().toString()));
+  for (Index i = 0; i < func->getNumLocals(); i++) {
+    hash.update(std::string_view(func->getLocalType(i).toString()));
+    hash.update(func->getLocalNameOrDefault(i));
+  }
+  // Without the function, locals print by index and are covered above.
+  std::ostringstream body;
+  body << *func->body;
+  hash.update(std::string_view(body.str()));
+  return hash.state;
+}
+
+PlanCache::PlanCache(std::filesystem::path dir) : dir(std::move(dir)) {
+  std::error_code ec;
+  std::filesystem::create_directories(this->dir, ec);
+  if (ec) {
+    WNDPE_LOG(Info,
+              "Can't create plan cache directory {}: {}\n",
+              this->dir.string(),
+              ec.message());
+  }
+}
+
+std::filesystem::path PlanCache::getEntryPath(uint64_t key) const {
+  return dir / fmt::format("{:016x}.plan", key);
+}
+
+std::filesystem::path PlanCache::getOutputPath(uint64_t key) const {
+  return dir / fmt::format("{:016x}.out", key);
+}
+
+std::optional<OutliningPlan> PlanCache::load(uint64_t key) const {
+  std::ifstream in(getEntryPath(key));
+  if (!in) {
+    return std::nullopt;
+  }
+  std::string header;
+  std::getline(in, header);
+  if (header != PlanFormat) {
+    return std::nullopt;
+  }
+  OutliningPlan plan;
+  size_t numRegions = 0;
+  std::string word;
+  if (!(in >> word >> plan.numLocals) || word != "locals" ||
+      !(in >> word >> numRegions) || word != "regions") {
+    return std::nullopt;
+  }
+  plan.regions.resize(numRegions);
+  for (OutliningPlan::Region& region : plan.regions) {
+    if (!(in >> word) || word != "region" ||
+        !readIndices(in, plan.numLocals, region.inputs) ||
+        !readIndices(in, plan.numLocals, region.outputs)) {
+      return std::nullopt;
+    }
+  }
+  return plan;
+}
+
+void PlanCache::store(uint64_t key, const OutliningPlan& plan) const {
+  std::ostringstream out;
+  out << PlanFormat << "\nlocals " << plan.numLocals << "\nregions "
+      << plan.regions.size() << '\n';
+  for (const OutliningPlan::Region& region : plan.regions) {
+    out << "region";
+    writeIndices(out, region.inputs);
+    writeIndices(out, region.outputs);
+    out << '\n';
+  }
+  writeEntry(getEntryPath(key), out.str());
+}
+
+std::optional<std::string> PlanCache::loadOutput(uint64_t key) const {
+  std::ifstream in(getOutputPath(key));
+  if (!in) {
+    return std::nullopt;
+  }
+  std::string header;
+  std::getline(in, header);
+  std::ostringstream output;
+  if (header != OutputFormat || !(output << in.rdbuf())) {
+    return std::nullopt;
+  }
+  return output.str();
+}
+
+void PlanCache::storeOutput(uint64_t key, std::string_view output) const {
+  std::string contents(OutputFormat);
+  contents += '\n';
+  contents += output;
+  writeEntry(getOutputPath(key), contents);
+}
+
+void PlanCache::writeEntry(const std::filesystem::path& entry,
+                           std::string_view contents) const {
+  // Write to a private file first so readers never see a partial entry. The
+  // random part keeps other processes writing the same entry apart.
+  static const uint32_t tempTag = std::random_device{}();
+  static std::atomic<uint64_t> tempCounter = 0;
+  std::filesystem::path temp = entry;
+  temp += fmt::format(".{:08x}.{}.tmp", tempTag, tempCounter++);
+  bool written;
+  {
+    std::ofstream file(temp);
+    written = static_cast<bool>(file << contents << std::flush);
+  }
+  std::error_code ec;
+  if (!written) {
+    WNDPE_LOG(Debug, "Can't write plan cache entry {}\n", temp.string());
+    std::filesystem::remove(temp, ec);
+    return;
+  }
+  std::filesystem::rename(temp, entry, ec);
+  if (ec) {
+    WNDPE_LOG(Debug,
+              "Can't write plan cache entry {}: {}\n",
+              entry.string(),
+              ec.message());
+    std::filesystem::remove(temp, ec);
+  }
+}
+
+} // namespace wasm
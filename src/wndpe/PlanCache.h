@@ -0,0 +1,66 @@
+#ifndef WNDPE_PLANCACHE_H_INCLUDED
+#define WNDPE_PLANCACHE_H_INCLUDED 1
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <wasm.h>
+
+namespace wasm {
+
+// The result of the outlining analysis of one function: everything the
+// rewrite needs besides the function itself.
+struct OutliningPlan {
+  struct Region {
+    // Locals shipped into and out of the region, ascending.
+    std::vector<Index> inputs;
+    std::vector<Index> outputs;
+  };
+
+  Index numLocals = 0;
+  // In walk order of the begin markers.
+  std::vector<Region> regions;
+};
+
+// Structural hash of everything the plan of func depends on: its signature,
+// local types, control flow, local accesses and call targets. Stable across
+// runs and processes, and much cheaper than printing the body.
+uint64_t hashFunctionContents(Function* func);
+
+// Hash of everything the outlining result of func depends on: its name,
+// signature, locals and the printed body, plus the module-wide settings in
+// context. Printing makes it a lot more expensive than hashFunctionContents,
+// but it covers constants and operators too.
+uint64_t hashFunctionOutput(Function* func, std::string_view context);
+
+// Directory of plans keyed by hashFunctionContents, and of outlining
+// results keyed by hashFunctionOutput. Any number of processes may share
+// one; entries are written atomically. The cache only ever speeds things
+// up, so unreadable entries are misses and failed writes are ignored.
+class PlanCache {
+public:
+  explicit PlanCache(std::filesystem::path dir);
+
+  std::optional<OutliningPlan> load(uint64_t key) const;
+  void store(uint64_t key, const OutliningPlan& plan) const;
+
+  // Outputs are opaque text to the cache.
+  std::optional<std::string> loadOutput(uint64_t key) const;
+  void storeOutput(uint64_t key, std::string_view output) const;
+
+private:
+  std::filesystem::path getEntryPath(uint64_t key) const;
+  std::filesystem::path getOutputPath(uint64_t key) const;
+  void writeEntry(const std::filesystem::path& entry,
+                  std::string_view contents) const;
+
+  std::filesystem::path dir;
+};
+
+} // namespace wasm
+
+#endif
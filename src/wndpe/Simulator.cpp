@@ -0,0 +1,364 @@
+#include "wndpe/wndpe.h"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <ir/find_all.h>
+#include <shell-interface.h>
+#include <wasm-interpreter.h>
+
+#include <fmt/core.h>
+
+#include "wndpe/Intrinsics.h"
+
+namespace wndpe {
+
+using namespace wasm;
+
+namespace {
+
+// Comm blocks are carved from chunks of at least this many pages.
+constexpr Address::address64_t ScratchPages = 16;
+constexpr Address::address64_t ScratchAlign = 16;
+
+// Raises the maximum of the memory by ScratchPages for as long as it lives,
+// so a module that declares a tight maximum still has room for the comm
+// blocks.
+class ScratchAllowance {
+public:
+  explicit ScratchAllowance(Module& wasm) {
+    if (!wasm.memory.exists || !wasm.memory.hasMax()) {
+      return;
+    }
+    memory = &wasm.memory;
+    oldMax = memory->max;
+    memory->max = oldMax + ScratchPages;
+  }
+  ~ScratchAllowance() {
+    if (memory) {
+      memory->max = oldMax;
+    }
+  }
+
+  ScratchAllowance(const ScratchAllowance&) = delete;
+  ScratchAllowance& operator=(const ScratchAllowance&) = delete;
+
+private:
+  Memory* memory = nullptr;
+  Address oldMax;
+};
+
+// Counts the memory traffic of the instance and implements the outlining
+// intrinsics: markers track the region the original module is in, offload
+// calls run the outlined function in the same instance.
+class SimulatorInterface : public ShellExternalInterface {
+public:
+  SimulatorInterface(SimulatedRun& run,
+                     std::vector<RegionTraffic>& regions,
+                     bool hasMemory,
+                     Type ptrType)
+    : run(run), regions(regions), hasMemory(hasMemory), ptrType(ptrType) {
+    for (size_t i = 0; i < regions.size(); i++) {
+      regionIndices[regions[i].function] = i;
+    }
+  }
+
+  void init(Module& wasm, ModuleRunner& instance) override {
+    ShellExternalInterface::init(wasm, instance);
+    this->instance = &instance;
+  }
+
+  Literals callImport(Function* import, Literals& arguments) override {
+    if (import->module != IntrinsicsModule) {
+      return ShellExternalInterface::callImport(import, arguments);
+    }
+    if (import->base == IntrinsicOutlineBegin) {
+      regionDepth++;
+      return {};
+    } else if (import->base == IntrinsicOutlineEnd) {
+      regionDepth--;
+      return {};
+    } else if (import->base == IntrinsicOutlineAlloc) {
+      return {Literal::makeFromInt64(allocate(arguments[0].getInteger()),
+                                     ptrType)};
+    } else if (import->base == IntrinsicOutlineFree) {
+      if (--liveBlocks == 0) {
+        scratchUsed = 0;
+      }
+      return {};
+    } else if (import->base == IntrinsicOutlineCall) {
+      return offload(arguments);
+    }
+    throw std::runtime_error(
+      fmt::format("Unknown intrinsic {}", import->base.c_str()));
+  }
+
+  // Loads and stores are all the interpreter's memory traffic, including the
+  // bytes moved by bulk memory and atomic operations.
+
+  int8_t load8s(Address addr) override {
+    countLoad(1);
+    return ShellExternalInterface::load8s(addr);
+  }
+  uint8_t load8u(Address addr) override {
+    countLoad(1);
+    return ShellExternalInterface::load8u(addr);
+  }
+  int16_t load16s(Address addr) override {
+    countLoad(2);
+    return ShellExternalInterface::load16s(addr);
+  }
+  uint16_t load16u(Address addr) override {
+    countLoad(2);
+    return ShellExternalInterface::load16u(addr);
+  }
+  int32_t load32s(Address addr) override {
+    countLoad(4);
+    return ShellExternalInterface::load32s(addr);
+  }
+  uint32_t load32u(Address addr) override {
+    countLoad(4);
+    return ShellExternalInterface::load32u(addr);
+  }
+  int64_t load64s(Address addr) override {
+    countLoad(8);
+    return ShellExternalInterface::load64s(addr);
+  }
+  uint64_t load64u(Address addr) override {
+    countLoad(8);
+    return ShellExternalInterface::load64u(addr);
+  }
+  std::array<uint8_t, 16> load128(Address addr) override {
+    countLoad(16);
+    return ShellExternalInterface::load128(addr);
+  }
+
+  void store8(Address addr, int8_t value) override {
+    countStore(1);
+    ShellExternalInterface::store8(addr, value);
+  }
+  void store16(Address addr, int16_t value) override {
+    countStore(2);
+    ShellExternalInterface::store16(addr, value);
+  }
+  void store32(Address addr, int32_t value) override {
+    countStore(4);
+    ShellExternalInterface::store32(addr, value);
+  }
+  void store64(Address addr, int64_t value) override {
+    countStore(8);
+    ShellExternalInterface::store64(addr, value);
+  }
+  void store128(Address addr, const std::array<uint8_t, 16>& value) override {
+    countStore(16);
+    ShellExternalInterface::store128(addr, value);
+  }
+
+  // The shell prints traps to stdout, report them to the caller instead.
+  void trap(const char* why) override {
+    throw std::runtime_error(fmt::format("Simulation trapped: {}", why));
+  }
+  void hostLimit(const char* why) override {
+    throw std::runtime_error(
+      fmt::format("Simulation hit a host limit: {}", why));
+  }
+
+private:
+  // Comm blocks come from pages the simulator grows the memory by, so the
+  // guest sees them as taken: its own allocator, growing the memory from
+  // memory.size, never hands out the same bytes.
+  Address::address64_t allocate(int64_t bytes) {
+    if (!hasMemory) {
+      throw std::runtime_error("Offloading needs a memory for comm blocks");
+    }
+    if (bytes < 0) {
+      throw std::runtime_error(
+        fmt::format("Invalid comm block size {}", bytes));
+    }
+    Address::address64_t offset =
+      (scratchUsed + ScratchAlign - 1) / ScratchAlign * ScratchAlign;
+    if (offset + bytes > scratchSize) {
+      // Blocks still live in the old chunk stay where they are, the chunk
+      // is simply not reused.
+      Address::address64_t pages = std::max<Address::address64_t>(
+        ScratchPages,
+        (bytes + Memory::kPageSize - 1) / Memory::kPageSize);
+      scratchBase = growMemory(pages);
+      scratchSize = pages * Memory::kPageSize;
+      offset = 0;
+    }
+    scratchUsed = offset + bytes;
+    liveBlocks++;
+    return scratchBase + offset;
+  }
+
+  // Runs memory.grow in the instance, returns the address of the new pages.
+  Address::address64_t growMemory(Address::address64_t pages) {
+    Const delta;
+    delta.value = Literal::makeFromInt64(pages, ptrType);
+    delta.type = ptrType;
+    MemoryGrow grow;
+    grow.delta = &delta;
+    if (ptrType == Type::i64) {
+      grow.make64();
+    }
+    grow.finalize();
+    int64_t oldPages = instance->visit(&grow).getSingleValue().getInteger();
+    if (oldPages < 0) {
+      throw std::runtime_error(
+        fmt::format("Can't grow the memory by {} pages for comm blocks",
+                    pages));
+    }
+    return Address::address64_t(oldPages) * Memory::kPageSize;
+  }
+
+  Literals offload(Literals& arguments) {
+    Name target = arguments[0].getFunc();
+    uint64_t size = arguments[2].getInteger();
+    auto found = regionIndices.find(target.c_str());
+    if (found == regionIndices.end()) {
+      throw std::runtime_error(
+        fmt::format("{} is offloaded but isn't an outlined function",
+                    target.c_str()));
+    }
+    RegionTraffic* outer = currentRegion;
+    currentRegion = &regions[found->second];
+    currentRegion->calls++;
+    currentRegion->commBytes += 2 * size;
+    run.offloadCalls++;
+    run.commBytes += 2 * size;
+    regionDepth++;
+    Literals results =
+      instance->callFunction(target, {arguments[1], arguments[2]});
+    regionDepth--;
+    currentRegion = outer;
+    return results;
+  }
+
+  void countLoad(uint64_t bytes) {
+    if (regionDepth == 0) {
+      run.hostLoadBytes += bytes;
+      return;
+    }
+    run.regionLoadBytes += bytes;
+    if (currentRegion) {
+      currentRegion->loadBytes += bytes;
+    }
+  }
+
+  void countStore(uint64_t bytes) {
+    if (regionDepth == 0) {
+      run.hostStoreBytes += bytes;
+      return;
+    }
+    run.regionStoreBytes += bytes;
+    if (currentRegion) {
+      currentRegion->storeBytes += bytes;
+    }
+  }
+
+  SimulatedRun& run;
+  std::vector<RegionTraffic>& regions;
+  std::unordered_map<std::string, size_t> regionIndices;
+  bool hasMemory;
+  Type ptrType;
+  ModuleRunner* instance = nullptr;
+  int regionDepth = 0;
+  RegionTraffic* currentRegion = nullptr;
+  // Chunk the next comm block is allocated from.
+  Address::address64_t scratchBase = 0;
+  Address::address64_t scratchSize = 0;
+  Address::address64_t scratchUsed = 0;
+  size_t liveBlocks = 0;
+};
+
+// The functions the offload calls of the module pass by ref.func: outlined
+// functions, and the batch wrappers of regions offloaded in batches (whose
+// outlined function is only called by the wrapper). In module order.
+std::vector<RegionTraffic> findOutlinedFunctions(Module& wasm) {
+  std::unordered_set<Name> targets;
+  for (auto& func : wasm.functions) {
+    if (func->imported()) {
+      continue;
+    }
+    for (Call* call : FindAll<Call>(func->body).list) {
+      if (call->target != IntrinsicOutlineCall || call->operands.empty()) {
+        continue;
+      }
+      if (auto* ref = call->operands[0]->dynCast<RefFunc>()) {
+        targets.insert(ref->func);
+      }
+    }
+  }
+  std::vector<RegionTraffic> regions;
+  for (auto& func : wasm.functions) {
+    if (targets.count(func->name)) {
+      regions.push_back(RegionTraffic{func->name.c_str()});
+    }
+  }
+  return regions;
+}
+
+SimulatedRun simulate(Module& wasm,
+                      std::string_view entry,
+                      const Literals& args,
+                      std::vector<RegionTraffic>& regions) {
+  Export* exp = wasm.getExportOrNull(Name(entry));
+  if (!exp || exp->kind != ExternalKind::Function) {
+    throw std::runtime_error(
+      fmt::format("No exported function named {}", entry));
+  }
+  Function* func = wasm.getFunction(exp->value);
+  Literals fullArgs;
+  Index index = 0;
+  for (Type param : func->getParams()) {
+    fullArgs.push_back(index < args.size() ? args[index]
+                                           : Literal::makeZero(param));
+    index++;
+  }
+
+  SimulatedRun run;
+  ScratchAllowance allowance(wasm);
+  SimulatorInterface interface(
+    run, regions, wasm.memory.exists, getPointerType(wasm));
+  ModuleRunner instance(wasm, &interface);
+  run.results = instance.callExport(exp->name, fullArgs);
+  return run;
+}
+
+} // namespace
+
+SimulationReport simulateOffload(wasm::Module& original,
+                                 wasm::Module& outlined,
+                                 std::string_view entry,
+                                 const wasm::Literals& args,
+                                 const LinkModel& link) {
+  SimulationReport report;
+  std::vector<RegionTraffic> noRegions;
+  report.original = simulate(original, entry, args, noRegions);
+  report.regions = findOutlinedFunctions(outlined);
+  report.outlined = simulate(outlined, entry, args, report.regions);
+  report.resultsMatch = report.original.results == report.outlined.results;
+
+  const SimulatedRun& before = report.original;
+  const SimulatedRun& after = report.outlined;
+  uint64_t hostBytes = before.hostLoadBytes + before.hostStoreBytes +
+                       before.regionLoadBytes + before.regionStoreBytes;
+  report.hostSeconds = hostBytes / link.hostBandwidth;
+  report.offloadSeconds =
+    (after.hostLoadBytes + after.hostStoreBytes) / link.hostBandwidth +
+    (after.regionLoadBytes + after.regionStoreBytes) / link.ndpBandwidth +
+    after.offloadCalls * link.latencySeconds +
+    after.commBytes / link.linkBandwidth;
+  report.speedup = report.offloadSeconds > 0
+                     ? report.hostSeconds / report.offloadSeconds
+                     : 1.0;
+  return report;
+}
+
+} // namespace wndpe
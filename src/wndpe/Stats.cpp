@@ -0,0 +1,118 @@
+#include "wndpe/Instrumentation.h"
+
+#include <algorithm>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include <fmt/format.h>
+
+namespace wndpe {
+
+std::atomic<int> currentLogLevel{static_cast<int>(LogLevel::Info)};
+
+void setLogLevel(LogLevel level) {
+  currentLogLevel.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+LogLevel getLogLevel() {
+  return static_cast<LogLevel>(
+    currentLogLevel.load(std::memory_order_relaxed));
+}
+
+void Stats::samplePeakMemory() {
+#if defined(__unix__) || defined(__APPLE__)
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+    std::uint64_t bytes = usage.ru_maxrss;
+#else
+    std::uint64_t bytes = std::uint64_t(usage.ru_maxrss) * 1024;
+#endif
+    peakRssBytes = std::max(peakRssBytes, bytes);
+  }
+#endif
+}
+
+std::string toJsonString(std::string_view text) {
+  std::string out = "\"";
+  for (char c : text) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out += fmt::format("\\u{:04x}", static_cast<unsigned>(c));
+        } else {
+          out += c;
+        }
+    }
+  }
+  out += '"';
+  return out;
+}
+
+std::string Stats::toJson() const {
+  fmt::memory_buffer out;
+  auto it = std::back_inserter(out);
+  fmt::format_to(it,
+                 "{{\"phases\":{{\"load\":{},\"validate\":{},"
+                 "\"candidates\":{},\"outlining\":{},\"cfg\":{},\"copy\":{},"
+                 "\"dce\":{},\"write\":{}}},",
+                 phases.load,
+                 phases.validate,
+                 phases.candidates,
+                 phases.outlining,
+                 phases.cfg,
+                 phases.copy,
+                 phases.dce,
+                 phases.write);
+  fmt::format_to(it,
+                 "\"functionsOutlined\":{},\"regions\":{},\"basicBlocks\":{},"
+                 "\"expressionsCopied\":{},\"commBlockBytes\":{},"
+                 "\"batchedRegions\":{},\"cacheHits\":{},\"cacheMisses\":{},"
+                 "\"peakRssBytes\":{},"
+                 "\"functions\":[",
+                 functionsOutlined,
+                 regions,
+                 basicBlocks,
+                 expressionsCopied,
+                 commBlockBytes,
+                 batchedRegions,
+                 cacheHits,
+                 cacheMisses,
+                 peakRssBytes);
+  for (size_t i = 0; i < functions.size(); i++) {
+    const FunctionStats& f = functions[i];
+    fmt::format_to(it,
+                   "{}{{\"name\":{},\"regions\":{},\"basicBlocks\":{},"
+                   "\"cfgSeconds\":{},\"copySeconds\":{},"
+                   "\"expressionsCopied\":{},\"commBlockBytes\":{},"
+                   "\"batchedRegions\":{}}}",
+                   i == 0 ? "" : ",",
+                   toJsonString(f.name),
+                   f.regions,
+                   f.basicBlocks,
+                   f.cfgSeconds,
+                   f.copySeconds,
+                   f.expressionsCopied,
+                   f.commBlockBytes,
+                   f.batchedRegions);
+  }
+  fmt::format_to(it, "]}}");
+  return fmt::to_string(out);
+}
+
+} // namespace wndpe
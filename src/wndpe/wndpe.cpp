@@ -1,26 +1,38 @@
 
 #include "wndpe/wndpe.h"
 
+#include <ir/module-utils.h>
 #include <pass.h>
-#include <shell-interface.h>
 #include <support/command-line.h>
 #include <support/debug.h>
 #include <support/file.h>
 #include <wasm-binary.h>
-#include <wasm-interpreter.h>
 #include <wasm-io.h>
 #include <wasm-s-parser.h>
 #include <wasm-validator.h>
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
 #include <fmt/core.h>
 
+#include "wndpe/Instrumentation.h"
+
 namespace wasm {
-Pass* createNdpOutliningPass();
+Pass* createNdpOutliningPass(const wndpe::OutliningOptions& options);
 }
 
 namespace wndpe {
 
-std::unique_ptr<wasm::Module> loadModule(const std::filesystem::path& path) {
+namespace {
+
+constexpr std::array<std::byte, 4> WasmMagic = {
+  std::byte{0x00}, std::byte{0x61}, std::byte{0x73}, std::byte{0x6d}};
+
+std::unique_ptr<wasm::Module> makeModule() {
   std::unique_ptr wmod = std::make_unique<wasm::Module>();
   wmod->features.setMVP();
   wmod->features.setAtomics();
@@ -30,46 +42,186 @@ std::unique_ptr<wasm::Module> loadModule(const std::filesystem::path& path) {
   wmod->features.setReferenceTypes();
   wmod->features.setSIMD();
   wmod->features.setRelaxedSIMD();
-  wasm::ModuleReader reader;
-  reader.setProfile(wasm::IRProfile::Normal);
+  wmod->features.setTailCall();
+  return wmod;
+}
+
+void parseModule(wasm::Module& wmod,
+                 std::span<const std::byte> data,
+                 std::string_view sourceMap) {
+  const char* chars = reinterpret_cast<const char*>(data.data());
+  if (data.size() >= WasmMagic.size() &&
+      std::equal(WasmMagic.begin(), WasmMagic.end(), data.begin())) {
+    std::vector<char> input(chars, chars + data.size());
+    wasm::WasmBinaryBuilder parser(wmod, wmod.features, input);
+    std::istringstream sourceMapStream{std::string(sourceMap)};
+    if (!sourceMap.empty()) {
+      parser.setDebugLocations(&sourceMapStream);
+    }
+    parser.read();
+    return;
+  }
+  // The s-expression parser wants a mutable, zero terminated buffer.
+  std::string text(chars, data.size());
+  wasm::SExpressionParser parser(text.data());
+  wasm::Element& root = *parser.root;
+  if (root.size() == 0) {
+    throw ModuleError("Input contains no module");
+  }
+  wasm::SExpressionWasmBuilder builder(
+    wmod, *root[0], wasm::IRProfile::Normal);
+}
+
+} // namespace
+
+std::unique_ptr<wasm::Module> loadModule(const std::filesystem::path& path,
+                                         Stats* stats) {
+  std::vector<std::byte> data;
+  {
+    ScopedTimer timer(stats ? &stats->phases.load : nullptr);
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      throw ModuleError(
+        fmt::format("{}: can't open for reading", path.string()));
+    }
+    // A directory opens fine on some platforms, but has no size.
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+    if (!in || size < 0) {
+      throw ModuleError(fmt::format("{}: can't read", path.string()));
+    }
+    data.resize(static_cast<size_t>(size));
+    in.seekg(0, std::ios::beg);
+    if (!in.read(reinterpret_cast<char*>(data.data()), data.size())) {
+      throw ModuleError(fmt::format("{}: read error", path.string()));
+    }
+  }
+  try {
+    return loadModule(data, {}, stats);
+  } catch (const ModuleError& e) {
+    throw ModuleError(fmt::format("{}: {}", path.string(), e.what()));
+  }
+}
+
+std::unique_ptr<wasm::Module> loadModule(std::span<const std::byte> data,
+                                         std::string_view sourceMap,
+                                         Stats* stats) {
+  auto wmod = makeModule();
   try {
-    reader.read(path.string(), *wmod, "");
+    ScopedTimer timer(stats ? &stats->phases.load : nullptr);
+    parseModule(*wmod, data, sourceMap);
   } catch (wasm::ParseException& p) {
-    p.dump(std::cerr);
-    std::cerr << '\n';
-    fmt::print(stderr, "error parsing wasm\n");
-    std::exit(1);
+    std::ostringstream message;
+    p.dump(message);
+    throw ModuleError(fmt::format("Error parsing wasm: {}", message.str()));
   } catch (wasm::MapParseException& p) {
-    p.dump(std::cerr);
-    std::cerr << '\n';
-    fmt::print(stderr, "error parsing wasm source map\n");
-    std::exit(1);
+    std::ostringstream message;
+    p.dump(message);
+    throw ModuleError(
+      fmt::format("Error parsing wasm source map: {}", message.str()));
   } catch (std::bad_alloc&) {
-    fmt::print(stderr,
-               "error building module, std::bad_alloc (possibly invalid "
-               "request for silly amounts of memory)\n");
-    std::exit(1);
+    throw ModuleError("Error building module, std::bad_alloc (possibly "
+                      "invalid request for silly amounts of memory)");
   }
-  if (!wasm::WasmValidator().validate(*wmod)) {
-    fmt::print(stderr, "Error validating wasm\n");
-    std::exit(1);
+  {
+    ScopedTimer timer(stats ? &stats->phases.validate : nullptr);
+    // The validator can only print its findings, keep them for debugging.
+    wasm::WasmValidator::Flags flags = wasm::WasmValidator::Globally;
+    if (!isLogEnabled(LogLevel::Debug)) {
+      flags = flags | wasm::WasmValidator::Quiet;
+    }
+    if (!wasm::WasmValidator().validate(*wmod, flags)) {
+      throw ModuleError("Error validating wasm");
+    }
+  }
+  if (stats) {
+    stats->samplePeakMemory();
   }
   return wmod;
 }
 
-void runOutliningPasses(wasm::Module& wmod) {
-  wasm::PassRunner runner{&wmod};
-  runner.add(std::unique_ptr<wasm::Pass>(wasm::createNdpOutliningPass()));
-  runner.add("dce");
-  runner.run();
+void runOutliningPasses(wasm::Module& wmod, const OutliningOptions& options) {
+  Stats* stats = options.stats;
+  if (options.autoDetect) {
+    ScopedTimer timer(stats ? &stats->phases.candidates : nullptr);
+    auto candidates = markOffloadCandidates(wmod, options.candidates);
+    if (options.candidateReport) {
+      *options.candidateReport = std::move(candidates);
+    }
+  }
+  if (options.originalModule) {
+    *options.originalModule = std::make_unique<wasm::Module>();
+    wasm::ModuleUtils::copyModule(wmod, **options.originalModule);
+  }
+  // Separate runners so the cleanup is timed apart from the outlining itself.
+  {
+    ScopedTimer timer(stats ? &stats->phases.outlining : nullptr);
+    wasm::PassRunner runner{&wmod};
+    runner.add(
+      std::unique_ptr<wasm::Pass>(wasm::createNdpOutliningPass(options)));
+    runner.run();
+  }
+  {
+    ScopedTimer timer(stats ? &stats->phases.dce : nullptr);
+    wasm::PassRunner runner{&wmod};
+    runner.add("dce");
+    runner.run();
+  }
+  if (stats) {
+    stats->samplePeakMemory();
+  }
+}
+
+void writeWat(wasm::Module& wmod,
+              const std::filesystem::path& outPath,
+              Stats* stats) {
+  ScopedTimer timer(stats ? &stats->phases.write : nullptr);
+  std::ofstream out(outPath);
+  if (!out) {
+    throw ModuleError(
+      fmt::format("{}: can't open for writing", outPath.string()));
+  }
+  out << wmod;
+  if (!out.flush()) {
+    throw ModuleError(fmt::format("{}: write error", outPath.string()));
+  }
+}
+
+void writeBinary(wasm::Module& wmod,
+                 std::vector<std::byte>& out,
+                 const BinaryOptions& options,
+                 Stats* stats) {
+  ScopedTimer timer(stats ? &stats->phases.write : nullptr);
+  wasm::BufferWithRandomAccess buffer;
+  wasm::WasmBinaryWriter writer(&wmod, buffer);
+  writer.setNamesSection(options.debugInfo);
+  std::ostringstream sourceMapStream;
+  if (options.sourceMap) {
+    writer.setSourceMap(&sourceMapStream, options.sourceMapUrl);
+  }
+  writer.write();
+  out.resize(buffer.size());
+  std::memcpy(out.data(), buffer.data(), buffer.size());
+  if (options.sourceMap) {
+    *options.sourceMap = sourceMapStream.str();
+  }
 }
 
-void writeWat(wasm::Module& wmod, const std::filesystem::path& outPath) {
-  wasm::ModuleWriter writer;
-  Colors::setEnabled(false);
-  writer.setBinary(false);
-  writer.setDebugInfo(false);
-  writer.writeText(wmod, outPath.string());
+void writeBinary(wasm::Module& wmod,
+                 const std::filesystem::path& outPath,
+                 const BinaryOptions& options,
+                 Stats* stats) {
+  std::vector<std::byte> data;
+  writeBinary(wmod, data, options, stats);
+  ScopedTimer timer(stats ? &stats->phases.write : nullptr);
+  std::ofstream out(outPath, std::ios::binary);
+  if (!out) {
+    throw ModuleError(
+      fmt::format("{}: can't open for writing", outPath.string()));
+  }
+  if (!out.write(reinterpret_cast<const char*>(data.data()), data.size())) {
+    throw ModuleError(fmt::format("{}: write error", outPath.string()));
+  }
 }
 
 } // namespace wndpe
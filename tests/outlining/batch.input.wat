@@ -0,0 +1,21 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (memory $mem 1)
+  (func $scale (param $data i32) (param $n i32) (param $factor i32) (result i32)
+    (local $i i32)
+    (local $addr i32)
+    (local $last i32)
+    (loop $loop
+      (call $__wndpe_outline_begin)
+      (local.set $addr (i32.add (local.get $data) (i32.shl (local.get $i) (i32.const 2))))
+      (local.set $last (i32.mul (i32.load (local.get $addr)) (local.get $factor)))
+      (i32.store (local.get $addr) (local.get $last))
+      (call $__wndpe_outline_end)
+      (local.set $i (i32.add (local.get $i) (i32.const 1)))
+      (br_if $loop (i32.lt_u (local.get $i) (local.get $n)))
+    )
+    (local.get $last)
+  )
+  (export "scale" (func $scale))
+)
@@ -0,0 +1,23 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (memory $mem 1)
+  (func $find (param $ptr i32) (param $n i32) (param $key i32) (result i32)
+    (local $i i32)
+    (call $__wndpe_outline_begin)
+    (block $done
+      (loop $next
+        (br_if $done (i32.ge_u (local.get $i) (local.get $n)))
+        (if (i32.eq
+              (i32.load (i32.add (local.get $ptr) (i32.shl (local.get $i) (i32.const 2))))
+              (local.get $key))
+          (return (local.get $i)))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)
+      )
+    )
+    (call $__wndpe_outline_end)
+    (i32.const -1)
+  )
+  (export "find" (func $find))
+)
@@ -0,0 +1,27 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (memory $mem 1)
+  (func $gather (param $src i32) (param $dst i32) (param $table i32) (param $n i32)
+    (local $i i32)
+    (local $elem i32)
+    (local $next i32)
+    (call $__wndpe_outline_begin)
+    (memory.copy (local.get $dst) (local.get $src) (i32.shl (local.get $n) (i32.const 2)))
+    (block $done
+      (loop $loop
+        (br_if $done (i32.ge_u (local.get $i) (local.get $n)))
+        (local.set $elem (i32.add (local.get $dst) (i32.shl (local.get $i) (i32.const 2))))
+        (i32.store offset=4 (local.get $elem) (i32.load (local.get $elem)))
+        (local.set $next (i32.load (i32.add (local.get $table) (local.get $i))))
+        (drop (i32.load8_u (local.get $next)))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $loop)
+      )
+    )
+    (memory.fill (local.get $table) (i32.const 0) (i32.const 64))
+    (drop (memory.grow (i32.const 0)))
+    (call $__wndpe_outline_end)
+  )
+  (export "gather" (func $gather))
+)
@@ -0,0 +1,27 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (memory $mem 1)
+  (func $sum (param $ptr i32) (param $n i32) (result i64)
+    (local $i i32)
+    (local $acc i64)
+    (local $unused f64)
+    (local.set $unused (f64.const 1.5))
+    (call $__wndpe_outline_begin)
+    (block $done
+      (loop $next
+        (br_if $done (i32.ge_u (local.get $i) (local.get $n)))
+        (local.set $acc
+          (i64.add
+            (local.get $acc)
+            (i64.load (i32.add (local.get $ptr) (i32.shl (local.get $i) (i32.const 3))))))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)
+      )
+    )
+    (call $__wndpe_outline_end)
+    (drop (local.get $unused))
+    (local.get $acc)
+  )
+  (export "sum" (func $sum))
+)
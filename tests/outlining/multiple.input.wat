@@ -0,0 +1,36 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (memory $mem 1)
+  (func $scan_twice (param $ptr i32) (param $n i32) (result i32)
+    (local $i i32)
+    (local $hits i32)
+    (local $zeros i32)
+    (call $__wndpe_outline_begin)
+    (block $done
+      (loop $next
+        (br_if $done (i32.ge_u (local.get $i) (local.get $n)))
+        (if (i32.gt_s (i32.load (i32.add (local.get $ptr) (i32.shl (local.get $i) (i32.const 2))))
+                      (i32.const 100))
+          (local.set $hits (i32.add (local.get $hits) (i32.const 1))))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)
+      )
+    )
+    (call $__wndpe_outline_end)
+    (local.set $i (i32.const 0))
+    (call $__wndpe_outline_begin)
+    (block $done2
+      (loop $next2
+        (br_if $done2 (i32.ge_u (local.get $i) (local.get $n)))
+        (if (i32.eqz (i32.load (i32.add (local.get $ptr) (i32.shl (local.get $i) (i32.const 2)))))
+          (local.set $zeros (i32.add (local.get $zeros) (i32.const 1))))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next2)
+      )
+    )
+    (call $__wndpe_outline_end)
+    (i32.sub (local.get $hits) (local.get $zeros))
+  )
+  (export "scan_twice" (func $scan_twice))
+)
@@ -0,0 +1,14 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (func $nested (param $x i32) (result i32)
+    (call $__wndpe_outline_begin)
+    (local.set $x (i32.add (local.get $x) (i32.const 1)))
+    (call $__wndpe_outline_begin)
+    (local.set $x (i32.mul (local.get $x) (i32.const 3)))
+    (call $__wndpe_outline_end)
+    (call $__wndpe_outline_end)
+    (local.get $x)
+  )
+  (export "nested" (func $nested))
+)
@@ -0,0 +1,11 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (func $square (param $x i32) (result i32)
+    (call $__wndpe_outline_begin)
+    (local.set $x (i32.mul (local.get $x) (local.get $x)))
+    (call $__wndpe_outline_end)
+    (local.get $x)
+  )
+  (export "square" (func $square))
+)
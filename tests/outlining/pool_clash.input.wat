@@ -0,0 +1,14 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (memory $mem 1)
+  (global $__wndpe_pool_16 (mut i32) (i32.const 0))
+  (func $sum (param $ptr i32) (result i32)
+    (local $acc i32)
+    (call $__wndpe_outline_begin)
+    (local.set $acc (i32.add (i32.load (local.get $ptr)) (global.get $__wndpe_pool_16)))
+    (call $__wndpe_outline_end)
+    (local.get $acc)
+  )
+  (export "sum" (func $sum))
+)
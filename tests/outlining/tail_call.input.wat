@@ -0,0 +1,17 @@
+(module
+  (import "__builtins" "__wndpe_outline_begin" (func $__wndpe_outline_begin))
+  (import "__builtins" "__wndpe_outline_end" (func $__wndpe_outline_end))
+  (func $double (param $x i32) (result i32)
+    (i32.add (local.get $x) (local.get $x))
+  )
+  (func $tail (param $x i32) (result i32)
+    (call $__wndpe_outline_begin)
+    (if (i32.eqz (local.get $x))
+      (return_call $double (local.get $x))
+    )
+    (local.set $x (i32.sub (local.get $x) (i32.const 1)))
+    (call $__wndpe_outline_end)
+    (local.get $x)
+  )
+  (export "tail" (func $tail))
+)